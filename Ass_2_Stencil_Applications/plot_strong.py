@@ -1,3 +1,6 @@
+import csv
+import sys
+
 import matplotlib.pyplot as plt
 
 # Data for Strong Scalability Experiment
@@ -6,11 +9,27 @@ execution_times_strong = [0.1535, 0.0818, 0.0377, 0.0266, 0.0229, 0.0209, 0.0189
 speedup_strong = [1.0, 0.1535/0.0818, 0.1535/0.0377, 0.1535/0.0266, 0.1535/0.0229, 
                   0.1535/0.0209, 0.1535/0.0189, 0.1535/0.0193, 0.1535/0.0189]
 
+# With a CSV file written by `stencil -b`, every problem size and number of
+# iterations gets a curve of the speedup over the fewest processes it ran on
+curves = {}
+if len(sys.argv) > 1:
+    with open(sys.argv[1]) as file:
+        for row in csv.DictReader(file):
+            curves.setdefault((int(row['points']), int(row['steps'])), []).append((int(row['procs']), float(row['time'])))
+if not curves:
+    curves[None] = list(zip(processes, execution_times_strong))
 
 # Plotting Strong Scalability Experiment
 plt.figure(figsize=(10, 6))
-plt.plot(processes, speedup_strong, marker='o', label='Strong Scalability')
-plt.plot(processes, processes, '--', label='Ideal Speedup')
+all_processes = set()
+for (key, runs) in sorted(curves.items(), key=lambda item: item[0] or (0, 0)):
+    runs.sort()
+    base_processes, base_time = runs[0]
+    label = 'Strong Scalability' if key is None else '{:,} points, {} iterations'.format(*key)
+    plt.plot([p for (p, t) in runs], [base_time * base_processes / t for (p, t) in runs], marker='o', label=label)
+    all_processes.update(p for (p, t) in runs)
+all_processes = sorted(all_processes)
+plt.plot(all_processes, all_processes, '--', label='Ideal Speedup')
 plt.xlabel('Number of Processes')
 plt.ylabel('Speedup')
 plt.title('Strong Scalability Experiment')
@@ -1,3 +1,6 @@
+import csv
+import sys
+
 import matplotlib.pyplot as plt
 
 # 提取数据并计算效率
@@ -5,11 +8,37 @@ problem_sizes = [1000000, 2000000, 4000000, 8000000]
 efficiency_1mil = [1.00,1.08,1.04,0.95]
 efficiency_5mil = [0.83,1.36,0.92,0.52]
 
+# A CSV file written by `stencil -b ... -p` has a curve for every size per
+# process and number of iterations, with the efficiency it computed. The
+# lines of `stencil_grid -p -c` runs only have the time, so the efficiency is
+# computed the same way, as the throughput per process relative to the run
+# of the curve with the fewest processes
+curves = {}
+if len(sys.argv) > 1:
+    runs_by_key = {}
+    with open(sys.argv[1]) as file:
+        for row in csv.DictReader(file):
+            key = (int(row['points']) // int(row['procs']), int(row['steps']))
+            runs_by_key.setdefault(key, []).append(row)
+    for key, rows in runs_by_key.items():
+        rows.sort(key=lambda row: int(row['procs']))
+        rate = lambda row: int(row['points']) * int(row['steps']) / max(float(row['time']), 1e-9) / int(row['procs'])
+        for row in rows:
+            efficiency = float(row['efficiency']) if 'efficiency' in row else rate(row) / rate(rows[0])
+            curves.setdefault(key, []).append((int(row['points']), efficiency))
+if curves:
+    problem_sizes = sorted(set(size for runs in curves.values() for (size, efficiency) in runs))
+else:
+    curves = {'10,000,000 per Process': list(zip(problem_sizes, efficiency_1mil)),
+              '5,000,000 per Process': list(zip(problem_sizes, efficiency_5mil))}
+
 # 绘制效率图
 plt.figure(figsize=(10, 6))
-plt.plot(problem_sizes, efficiency_1mil, marker='o', label='10,000,000 per Process')
-plt.plot(problem_sizes, efficiency_5mil, marker='s', label='5,000,000 per Process')
-plt.plot(problem_sizes, [1]*4, '--', label='Ideal Efficiency')
+for (key, runs), marker in zip(curves.items(), 'osv^<>dph*'):
+    runs.sort()
+    label = key if isinstance(key, str) else '{:,} per Process, {} iterations'.format(*key)
+    plt.plot([size for (size, efficiency) in runs], [efficiency for (size, efficiency) in runs], marker=marker, label=label)
+plt.plot(problem_sizes, [1]*len(problem_sizes), '--', label='Ideal Efficiency')
 plt.xlabel('Problem Size')
 plt.ylabel('Efficiency')
 plt.ylim(0, 1.5)
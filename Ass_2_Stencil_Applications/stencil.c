@@ -1,169 +1,1681 @@
+#define _POSIX_C_SOURCE 200809L
 #include "stencil.h"
+#include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-void setup_persistent_communications(int id, int procs, int extent, int recv_count, double* local_data, double* extended_data, MPI_Request *request) {
+// Halo messages carry the extent points next to each end of the local data,
+// which starts at extended_data[extent]. sides selects the neighbours to
+// exchange with, HALO_LEFT and/or HALO_RIGHT. Returns the number of requests.
+#define HALO_LEFT 1
+#define HALO_RIGHT 2
+int setup_persistent_communications(int id, int procs, int extent, int recv_count, double* extended_data, int sides, MPI_Request *request, MPI_Comm comm) {
     int left_rank = (id == 0) ? procs - 1 : id - 1;
     int right_rank = (id == procs - 1) ? 0 : id + 1;
+    int count = 0;
 
-    MPI_Send_init(&local_data[recv_count - extent], extent, MPI_DOUBLE, right_rank, 0, MPI_COMM_WORLD, &request[0]);
-    MPI_Recv_init(extended_data, extent, MPI_DOUBLE, left_rank, 0, MPI_COMM_WORLD, &request[1]);
-    MPI_Send_init(local_data, extent, MPI_DOUBLE, left_rank, 1, MPI_COMM_WORLD, &request[2]);
-    MPI_Recv_init(&extended_data[recv_count + extent], extent, MPI_DOUBLE, right_rank, 1, MPI_COMM_WORLD, &request[3]);
+    if (sides & HALO_RIGHT) {
+        MPI_Send_init(&extended_data[recv_count], extent, MPI_DOUBLE, right_rank, 0, comm, &request[count++]);
+    }
+    if (sides & HALO_LEFT) {
+        MPI_Recv_init(extended_data, extent, MPI_DOUBLE, left_rank, 0, comm, &request[count++]);
+        MPI_Send_init(&extended_data[extent], extent, MPI_DOUBLE, left_rank, 1, comm, &request[count++]);
+    }
+    if (sides & HALO_RIGHT) {
+        MPI_Recv_init(&extended_data[recv_count + extent], extent, MPI_DOUBLE, right_rank, 1, comm, &request[count++]);
+    }
+    return count;
 }
 
-void cleanup_persistent(MPI_Request *request) {
-    for (int i = 0; i < 4; i++) {
+void cleanup_persistent(int count, MPI_Request *request) {
+    for (int i = 0; i < count; i++) {
         MPI_Request_free(&request[i]);
     }
 }
+
+// Reads a comma separated list of stencil coefficients and scales them by
+// 1/h^derivative. Returns the number of coefficients.
+int parse_coefficients(const char *list, double h, int derivative, double **stencil) {
+    int width = 1;
+    for (const char *c = list; *c; c++) {
+        width += (',' == *c);
+    }
+    *stencil = malloc(width * sizeof(double));
+    double scale = pow(h, derivative);
+    const char *next = list;
+    for (int j = 0; j < width; j++) {
+        char *end;
+        (*stencil)[j] = strtod(next, &end) / scale;
+        if (end == next || (',' != *end && '\0' != *end)) {
+            free(*stencil);
+            *stencil = NULL;
+            return 0;
+        }
+        next = end + 1;
+    }
+    return width;
+}
+
+// Makes the stencil for the spacing h: either the given coefficients, scaled
+// by 1/h^derivative, or the central difference of the given width. Returns
+// the width, or 0 if there is no such stencil.
+int make_stencil(const char *coefficient_list, int width, int derivative, double h, double **stencil) {
+    *stencil = NULL;
+    if (NULL != coefficient_list) {
+        width = parse_coefficients(coefficient_list, h, derivative, stencil);
+    } else if (width >= 3 && NULL != (*stencil = malloc(width * sizeof(double)))) {
+        if (0 != stencil_coefficients(derivative, width, h, *stencil)) {
+            free(*stencil);
+            *stencil = NULL;
+        }
+    }
+    if (NULL == *stencil || width < 3 || width % 2 == 0) {
+        free(*stencil);
+        *stencil = NULL;
+        return 0;
+    }
+    return width;
+}
+
+// Allocates a zeroed buffer aligned for the vectorized kernels
+double *alloc_extended(int count) {
+    void *buffer = NULL;
+    if (0 != posix_memalign(&buffer, STENCIL_ALIGNMENT, count * sizeof(double))) {
+        return NULL;
+    }
+    memset(buffer, 0, count * sizeof(double));
+    return buffer;
+}
+
+// Applies the kernel to the calling thread's share of [first, last). The
+// shares start on cache line boundaries so that threads never write to the
+// same line.
+void apply_stencil_share(stencil_kernel kernel, const double *input, double *output, int first, int last, const double *stencil, int extent) {
+#ifdef _OPENMP
+    int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+#else
+    int threads = 1, thread = 0;
+#endif
+    const int LINE = STENCIL_ALIGNMENT / sizeof(double);
+    if (last <= first) {
+        return;
+    }
+    int share = ((last - first) / threads + LINE - 1) / LINE * LINE;
+    int start = (first + thread * share) / LINE * LINE;
+    int end = (first + (thread + 1) * share) / LINE * LINE;
+    if (thread == 0) {
+        start = first;
+    }
+    if (thread == threads - 1 || end > last) {
+        end = last;
+    }
+    if (start < end) {
+        kernel(input, output, start, end, stencil, extent);
+    }
+}
+
+// Chooses how many steps to take per halo exchange. With k steps per exchange
+// a step costs about latency/k + time_per_point*(recv_count + extent*(k-1)),
+// because the ghost zone shrinks by extent points per step, which is smallest
+// at k = sqrt(latency/(time_per_point*extent)). Both rates are measured here
+// and the slowest rank decides.
+int choose_halo_depth(int id, int procs, int extent, int recv_count, int num_threads, stencil_kernel kernel, const double *stencil, MPI_Comm comm) {
+    const int TRIALS = 10;
+    double *extended = alloc_extended(recv_count + 2 * extent);
+    double *scratch = alloc_extended(recv_count + 2 * extent);
+    MPI_Request request[4];
+    setup_persistent_communications(id, procs, extent, recv_count, extended, HALO_LEFT | HALO_RIGHT, request, comm);
+
+    // The first exchange pays for connection setup, so it is not timed
+    MPI_Startall(4, request);
+    MPI_Waitall(4, request, MPI_STATUSES_IGNORE);
+    MPI_Barrier(comm);
+    double start = MPI_Wtime();
+    for (int t = 0; t < TRIALS; t++) {
+        MPI_Startall(4, request);
+        MPI_Waitall(4, request, MPI_STATUSES_IGNORE);
+    }
+    double rates[2];
+    rates[0] = (MPI_Wtime() - start) / TRIALS;
+
+    start = MPI_Wtime();
+    for (int t = 0; t < TRIALS; t++) {
+        kernel(extended, scratch, extent, recv_count + extent, stencil, extent);
+    }
+    rates[1] = (MPI_Wtime() - start) / TRIALS / (recv_count > 0 ? recv_count : 1) / num_threads;
+
+    cleanup_persistent(4, request);
+    free(extended);
+    free(scratch);
+
+    double max_rates[2];
+    MPI_Allreduce(rates, max_rates, 2, MPI_DOUBLE, MPI_MAX, comm);
+    if (max_rates[1] <= 0) {
+        return 1;
+    }
+    return (int)(sqrt(max_rates[0] / (max_rates[1] * extent)) + 0.5);
+}
+
+// Reads one positive weight per process from a comma separated list
+int parse_weights(const char *list, int procs, double *weights) {
+    const char *next = list;
+    for (int r = 0; r < procs; r++) {
+        char *end;
+        weights[r] = strtod(next, &end);
+        if (end == next || !(weights[r] > 0) || ((r < procs - 1) ? ',' : '\0') != *end) {
+            return -1;
+        }
+        next = end + 1;
+    }
+    return 0;
+}
+
+// Measures how fast this rank applies the stencil by timing a few sweeps
+// over points values, and gathers the speeds of all ranks as their weights
+void calibrate_weights(int points, int extent, int num_threads, stencil_kernel kernel, const double *stencil, double *weights, MPI_Comm comm) {
+    const int TRIALS = 5;
+    double *input = alloc_extended(points + 2 * extent);
+    double *output = alloc_extended(points + 2 * extent);
+    double start = 0;
+
+    // The first sweep only warms up the caches and is not timed
+#pragma omp parallel num_threads(num_threads)
+    for (int t = 0; t <= TRIALS; t++) {
+#pragma omp master
+        if (1 == t) {
+            start = MPI_Wtime();
+        }
+        apply_stencil_share(kernel, input, output, extent, points + extent, stencil, extent);
+#pragma omp barrier
+    }
+    double elapsed = MPI_Wtime() - start;
+    double speed = TRIALS / (elapsed > 0 ? elapsed : 1e-9);
+    MPI_Allgather(&speed, 1, MPI_DOUBLE, weights, 1, MPI_DOUBLE, comm);
+
+    free(input);
+    free(output);
+}
+
+// Splits num_values points into contiguous slices in proportion to the
+// weights. displs has procs + 1 entries, so slice r is
+// [displs[r], displs[r + 1]). Equal weights give equal slices whenever
+// num_values is divisible by procs.
+void partition(int num_values, int procs, const double *weights, int *counts, int *displs) {
+    double total = 0, prefix = 0;
+    for (int r = 0; r < procs; r++) {
+        total += weights[r];
+    }
+    displs[0] = 0;
+    for (int r = 0; r < procs; r++) {
+        prefix += weights[r];
+        displs[r + 1] = (r == procs - 1) ? num_values : (int)llround(num_values * prefix / total);
+        counts[r] = displs[r + 1] - displs[r];
+    }
+}
+
+// Halo exchange backends. EXCHANGE_MSG sends the ghost points to every
+// neighbour with persistent requests. With EXCHANGE_SHM the buffers of the
+// ranks of a node are allocated in a shared memory window, and a neighbour
+// on the same node copies its ghost points straight out of them, so only the
+// neighbours on other nodes get messages. With EXCHANGE_RMA every buffer is
+// an RMA window, and the neighbours put the ghost points into it in a
+// post-start-complete-wait epoch per block.
+enum exchange { EXCHANGE_MSG, EXCHANGE_SHM, EXCHANGE_RMA };
+
+// The start of every rank's part of the shared window. The owner counts the
+// blocks whose input its buffers hold in ready and the blocks whose ghost
+// points it has copied from its neighbours in consumed; the neighbours poll
+// both. data_offset is the byte offset of the first buffer from the start,
+// as the window may be mapped at a different address in every process.
+struct shared_state {
+    volatile long ready;
+    volatile long consumed;
+    long data_offset;
+    int count;
+};
+
+// The local slice of count points with halo ghost points on each side. Each
+// step reads one extended buffer and writes the other, so the two buffers
+// need their own halo requests, or their own RMA windows. The buffers of the
+// neighbours on the same node are only set up for EXCHANGE_SHM, when they
+// are in shared memory. A snapshot writer, if set, is advanced at the start
+// of every block.
+struct domain {
+    MPI_Comm comm;
+    int count;
+    int halo;
+    double *extended[2];
+    MPI_Request request[2][4];
+    int num_requests;
+    int current;
+    enum exchange exchange;
+    MPI_Win window;
+    struct shared_state *state;
+    struct shared_state *neighbour_state[2];
+    const double *neighbour_extended[2][2];
+    long blocks;
+    MPI_Win rma_window[2];
+    MPI_Group neighbours;
+    int neighbour_ranks[2];
+    MPI_Aint put_displs[2][2];
+    snapshot_writer *snapshots;
+};
+
+// Allocates the two buffers of the domain in a window shared by the ranks
+// of the node, and finds the buffers of the left and right neighbours if
+// they are on the node. Returns the sides that still need messages. This is
+// a collective operation.
+int setup_shared_buffers(struct domain *local, int id, int procs) {
+    const int LINE = STENCIL_ALIGNMENT / sizeof(double);
+    const int neighbours[2] = {(id == 0) ? procs - 1 : id - 1, (id == procs - 1) ? 0 : id + 1};
+    MPI_Comm node;
+    MPI_Comm_split_type(local->comm, MPI_COMM_TYPE_SHARED, id, MPI_INFO_NULL, &node);
+    MPI_Group group, node_group;
+    MPI_Comm_group(local->comm, &group);
+    MPI_Comm_group(node, &node_group);
+    int node_ranks[2];
+    MPI_Group_translate_ranks(group, 2, neighbours, node_group, node_ranks);
+    MPI_Group_free(&group);
+    MPI_Group_free(&node_group);
+
+    // Every rank's part may be placed in its own NUMA domain, and the
+    // buffers start STENCIL_ALIGNMENT bytes after the state, or a little
+    // later to align them
+    long padded = (local->count + 2 * local->halo + LINE - 1) / LINE * LINE;
+    MPI_Aint size = 2 * STENCIL_ALIGNMENT + 2 * padded * sizeof(double);
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    char *base;
+    MPI_Win_allocate_shared(size, 1, info, node, &base, &local->window);
+    MPI_Info_free(&info);
+    local->state = (struct shared_state *)base;
+    local->state->ready = 0;
+    local->state->consumed = 0;
+    local->state->count = local->count;
+    local->state->data_offset = STENCIL_ALIGNMENT + (STENCIL_ALIGNMENT - (uintptr_t)(base + STENCIL_ALIGNMENT) % STENCIL_ALIGNMENT) % STENCIL_ALIGNMENT;
+    for (int b = 0; b < 2; b++) {
+        local->extended[b] = (double *)(base + local->state->data_offset) + b * padded;
+        memset(local->extended[b], 0, (local->count + 2 * local->halo) * sizeof(double));
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, local->window);
+    MPI_Win_sync(local->window);
+    MPI_Barrier(node);
+    MPI_Win_sync(local->window);
+
+    int sides = HALO_LEFT | HALO_RIGHT;
+    for (int side = 0; side < 2; side++) {
+        local->neighbour_state[side] = NULL;
+        if (MPI_UNDEFINED == node_ranks[side]) {
+            continue;
+        }
+        MPI_Aint neighbour_size;
+        int disp_unit;
+        char *neighbour_base;
+        MPI_Win_shared_query(local->window, node_ranks[side], &neighbour_size, &disp_unit, &neighbour_base);
+        struct shared_state *state = (struct shared_state *)neighbour_base;
+        long neighbour_padded = (state->count + 2 * local->halo + LINE - 1) / LINE * LINE;
+        local->neighbour_state[side] = state;
+        for (int b = 0; b < 2; b++) {
+            local->neighbour_extended[side][b] = (const double *)(neighbour_base + state->data_offset) + b * neighbour_padded;
+        }
+        sides &= ~((0 == side) ? HALO_LEFT : HALO_RIGHT);
+    }
+    MPI_Comm_free(&node);
+    return sides;
+}
+
+// Allocates the two buffers as RMA windows, and makes the group of the
+// neighbours that put their ghost points into them. The buffers are aligned
+// within the windows, so the displacements of the neighbours' ghost points
+// depend on where their buffers start and, on the right end, on the size of
+// the left neighbour's slice. They are sent over once here. This is a
+// collective operation.
+void setup_rma_windows(struct domain *local, int id, int procs) {
+    const int LINE = STENCIL_ALIGNMENT / sizeof(double);
+    int *ranks = local->neighbour_ranks;
+    ranks[0] = (id == 0) ? procs - 1 : id - 1;
+    ranks[1] = (id == procs - 1) ? 0 : id + 1;
+
+    // Puts and the epochs only, so no locks are needed
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "no_locks", "true");
+    long ghosts[2][2];
+    for (int b = 0; b < 2; b++) {
+        double *base;
+        MPI_Win_allocate((MPI_Aint)(local->count + 2 * local->halo + LINE) * sizeof(double), sizeof(double), info, local->comm, &base,
+                         &local->rma_window[b]);
+        long offset = (STENCIL_ALIGNMENT - (uintptr_t)base % STENCIL_ALIGNMENT) % STENCIL_ALIGNMENT / sizeof(double);
+        local->extended[b] = base + offset;
+        memset(local->extended[b], 0, (local->count + 2 * local->halo) * sizeof(double));
+        ghosts[b][0] = offset;
+        ghosts[b][1] = offset + local->halo + local->count;
+    }
+    MPI_Info_free(&info);
+
+    // Each neighbour gets the displacement of the ghost points on its side
+    long left_ghosts[2], right_ghosts[2];
+    for (int b = 0; b < 2; b++) {
+        MPI_Sendrecv(&ghosts[b][0], 1, MPI_LONG, ranks[0], 4, &right_ghosts[b], 1, MPI_LONG, ranks[1], 4, local->comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(&ghosts[b][1], 1, MPI_LONG, ranks[1], 5, &left_ghosts[b], 1, MPI_LONG, ranks[0], 5, local->comm, MPI_STATUS_IGNORE);
+    }
+    for (int b = 0; b < 2; b++) {
+        local->put_displs[b][0] = left_ghosts[b];
+        local->put_displs[b][1] = right_ghosts[b];
+    }
+
+    // With two ranks both neighbours are the same rank, which may only be
+    // in the group once
+    MPI_Group group;
+    MPI_Comm_group(local->comm, &group);
+    MPI_Group_incl(group, (ranks[0] == ranks[1]) ? 1 : 2, ranks, &local->neighbours);
+    MPI_Group_free(&group);
+}
+
+void setup_domain(struct domain *local, int id, int procs, int count, int halo, enum exchange exchange, MPI_Comm comm) {
+    local->comm = comm;
+    local->count = count;
+    local->halo = halo;
+    local->current = 0;
+    local->exchange = exchange;
+    local->window = MPI_WIN_NULL;
+    local->rma_window[0] = local->rma_window[1] = MPI_WIN_NULL;
+    local->blocks = 0;
+    local->snapshots = NULL;
+    int sides = HALO_LEFT | HALO_RIGHT;
+    if (EXCHANGE_SHM == exchange) {
+        sides = setup_shared_buffers(local, id, procs);
+    } else if (EXCHANGE_RMA == exchange) {
+        setup_rma_windows(local, id, procs);
+        sides = 0;
+    } else {
+        for (int b = 0; b < 2; b++) {
+            local->extended[b] = alloc_extended(count + 2 * halo);
+        }
+    }
+    for (int b = 0; b < 2; b++) {
+        local->num_requests = setup_persistent_communications(id, procs, halo, count, local->extended[b], sides, local->request[b], comm);
+    }
+}
+
+void free_domain(struct domain *local) {
+    for (int b = 0; b < 2; b++) {
+        cleanup_persistent(local->num_requests, local->request[b]);
+        if (MPI_WIN_NULL != local->rma_window[b]) {
+            MPI_Win_free(&local->rma_window[b]);
+        } else if (MPI_WIN_NULL == local->window) {
+            free(local->extended[b]);
+        }
+    }
+    if (MPI_WIN_NULL != local->window) {
+        MPI_Win_unlock_all(local->window);
+        MPI_Win_free(&local->window);
+    }
+    if (EXCHANGE_RMA == local->exchange) {
+        MPI_Group_free(&local->neighbours);
+    }
+}
+
+// Waits until a counter of a neighbour on the same node reaches value.
+// MPI_Win_sync makes the neighbour's stores visible. The core is handed
+// over while polling, in case the neighbour has to share it.
+void wait_for_neighbour(const volatile long *counter, long value, MPI_Win window) {
+    while (*counter < value) {
+        sched_yield();
+        MPI_Win_sync(window);
+    }
+    MPI_Win_sync(window);
+}
+
+// Starts the halo exchange of a buffer that holds the input of the next
+// block: the messages are started, the neighbours on the same node are
+// told that they can copy their ghost points, or the ends of the slice are
+// put into the neighbours' windows. Called by one thread, once every thread
+// is done writing the buffer.
+void start_halo(struct domain *local, int buffer) {
+    if (NULL != local->snapshots) {
+        progress_snapshot(local->snapshots);
+    }
+    if (MPI_WIN_NULL != local->window) {
+        MPI_Win_sync(local->window);
+        local->state->ready = local->blocks + 1;
+    }
+    if (EXCHANGE_RMA == local->exchange) {
+        const int HALO = local->halo;
+        MPI_Win window = local->rma_window[buffer];
+        MPI_Win_post(local->neighbours, 0, window);
+        MPI_Win_start(local->neighbours, 0, window);
+        MPI_Put(local->extended[buffer] + HALO, HALO, MPI_DOUBLE, local->neighbour_ranks[0], local->put_displs[buffer][0], HALO, MPI_DOUBLE, window);
+        MPI_Put(local->extended[buffer] + local->count, HALO, MPI_DOUBLE, local->neighbour_ranks[1], local->put_displs[buffer][1], HALO, MPI_DOUBLE, window);
+    }
+    MPI_Startall(local->num_requests, local->request[buffer]);
+}
+
+// Completes the halo exchange started by start_halo, including the epoch of
+// the puts into and out of the buffer's window. The ghost points of
+// the neighbours on the same node are copied from the ends of their slices
+// once their buffers are ready. The messages are completed first, so a rank
+// never polls while its own messages still need it.
+void finish_halo(struct domain *local, int buffer) {
+    MPI_Waitall(local->num_requests, local->request[buffer], MPI_STATUSES_IGNORE);
+    if (EXCHANGE_RMA == local->exchange) {
+        MPI_Win_complete(local->rma_window[buffer]);
+        MPI_Win_wait(local->rma_window[buffer]);
+    }
+    if (MPI_WIN_NULL == local->window) {
+        return;
+    }
+    const int HALO = local->halo;
+    for (int side = 0; side < 2; side++) {
+        const struct shared_state *state = local->neighbour_state[side];
+        if (NULL == state) {
+            continue;
+        }
+        wait_for_neighbour(&state->ready, local->blocks + 1, local->window);
+        if (0 == side) {
+            memcpy(local->extended[buffer], local->neighbour_extended[side][buffer] + state->count, HALO * sizeof(double));
+        } else {
+            memcpy(local->extended[buffer] + HALO + local->count, local->neighbour_extended[side][buffer] + HALO, HALO * sizeof(double));
+        }
+    }
+    MPI_Win_sync(local->window);
+    local->state->consumed = local->blocks + 1;
+}
+
+// Ends a block once its first step is done: the buffer it started from is
+// overwritten by later steps, so the neighbours on the same node must have
+// copied their ghost points from it. Called by one thread.
+void release_halo(struct domain *local) {
+    if (MPI_WIN_NULL != local->window) {
+        for (int side = 0; side < 2; side++) {
+            if (NULL != local->neighbour_state[side]) {
+                wait_for_neighbour(&local->neighbour_state[side]->consumed, local->blocks + 1, local->window);
+            }
+        }
+    }
+    local->blocks++;
+}
+
+// Advances the local points by block steps in tiles of tile points. Each
+// tile is copied with the block * extent input points it depends on at
+// either side into a scratch buffer, stepped there while it stays in cache,
+// updating extent fewer points at each side every step, and copied to the
+// output buffer. The points between tiles are updated by both neighbouring
+// tiles, which is the price of never leaving the cache. phase selects the
+// tiles that only read local points (0), the others (1), or all (2), and
+// the tiles are shared between the threads.
+void apply_tiles(const struct domain *local, int buffer, int block, int extent, stencil_kernel kernel, const double *stencil, int tile,
+                 double *scratch, int phase) {
+    const int LINE = STENCIL_ALIGNMENT / sizeof(double);
+    const int HALO = local->halo, reach = block * extent;
+    const double *input = local->extended[buffer];
+    double *output = local->extended[1 - buffer];
+    const int num_tiles = (local->count + tile - 1) / tile;
+    double *scratch_input = scratch, *scratch_output = scratch + (tile + 2 * HALO + 2 * LINE) / LINE * LINE;
+
+#pragma omp for schedule(dynamic)
+    for (int n = 0; n < num_tiles; n++) {
+        int first = HALO + n * tile;
+        int last = (first + tile < HALO + local->count) ? first + tile : HALO + local->count;
+        int inner = first - reach >= HALO && last + reach <= HALO + local->count;
+        if (2 != phase && inner != (0 == phase)) {
+            continue;
+        }
+
+        // The scratch buffers start at the same offset in a cache line as
+        // the copied points, so the vector kernels split them the same way
+        int offset = (first - reach) / LINE * LINE;
+        memcpy(scratch_input, input + offset, (last + reach - offset) * sizeof(double));
+        double *step_input = scratch_input, *step_output = scratch_output;
+        for (int t = 0; t < block; t++) {
+            int margin = (block - 1 - t) * extent;
+            kernel(step_input, step_output, first - margin - offset, last + margin - offset, stencil, extent);
+            double *swap = step_input;
+            step_input = step_output;
+            step_output = swap;
+        }
+        memcpy(output + first, step_input + first - offset, (last - first) * sizeof(double));
+    }
+}
+
+// Applies the stencil num_steps times. Every block of up to halo_depth steps
+// starts with a halo exchange, and each step of the block updates extent
+// fewer ghost points on each side than the one before, ending with exactly
+// the local points. The threads of the rank split every step between them,
+// and the master thread alone drives the halo exchange. With a tile size
+// the whole block is applied tile by tile instead.
+void run_steps(struct domain *local, int num_steps, int halo_depth, int extent, stencil_kernel kernel, const double *stencil, int num_threads,
+               int tile, double *interior_time, double *wait_time) {
+    const int HALO = local->halo;
+    const int extended_count = local->count + 2 * HALO;
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        int buffer = local->current;
+        double *scratch = (tile > 0) ? alloc_extended(2 * (tile + 2 * HALO + 2 * STENCIL_ALIGNMENT / sizeof(double))) : NULL;
+        for (int s = 0; s < num_steps; s += halo_depth) {
+            int block = (num_steps - s < halo_depth) ? num_steps - s : halo_depth;
+
+#pragma omp master
+            start_halo(local, buffer);
+
+            if (tile > 0) {
+                // Tiles that only read local points are computed while the
+                // halo is in flight
+                double t0 = MPI_Wtime();
+                apply_tiles(local, buffer, block, extent, kernel, stencil, tile, scratch, 0);
+#pragma omp master
+                {
+                    double t1 = MPI_Wtime();
+                    finish_halo(local, buffer);
+                    double t2 = MPI_Wtime();
+                    *interior_time += t1 - t0;
+                    *wait_time += t2 - t1;
+                }
+#pragma omp barrier
+                apply_tiles(local, buffer, block, extent, kernel, stencil, tile, scratch, 1);
+#pragma omp master
+                release_halo(local);
+#pragma omp barrier
+                buffer = 1 - buffer;
+                continue;
+            }
+
+            for (int t = 0; t < block; t++) {
+                const double *step_input = local->extended[buffer];
+                double *step_output = local->extended[1 - buffer];
+                int first = (halo_depth - block + t + 1) * extent;
+                int last = extended_count - first;
+
+                if (t == 0) {
+                    // Points that only read local data are computed while the
+                    // halo is in flight; the rest wait for it.
+                    int inner_first = HALO + extent;
+                    int inner_last = HALO + local->count - extent;
+                    if (inner_last < inner_first) {
+                        inner_last = inner_first;
+                    }
+
+                    double t0 = MPI_Wtime();
+                    apply_stencil_share(kernel, step_input, step_output, inner_first, inner_last, stencil, extent);
+#pragma omp master
+                    {
+                        double t1 = MPI_Wtime();
+                        finish_halo(local, buffer);
+                        double t2 = MPI_Wtime();
+                        *interior_time += t1 - t0;
+                        *wait_time += t2 - t1;
+                    }
+#pragma omp barrier
+
+                    apply_stencil_share(kernel, step_input, step_output, first, inner_first, stencil, extent);
+                    apply_stencil_share(kernel, step_input, step_output, inner_last, last, stencil, extent);
+                } else {
+                    apply_stencil_share(kernel, step_input, step_output, first, last, stencil, extent);
+                }
+#pragma omp master
+                if (t == 0) {
+                    release_halo(local);
+                }
+
+                // Swap input and output once every thread is done with the step
+#pragma omp barrier
+                buffer = 1 - buffer;
+            }
+        }
+        free(scratch);
+#pragma omp master
+        local->current = buffer;
+    }
+}
+
+// Returns the size in bytes of the data or unified cache of the given level
+// of the first CPU, or 0 if it is unknown
+long cache_size(int level) {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    const int NAMES[3] = {_SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL2_CACHE_SIZE, _SC_LEVEL3_CACHE_SIZE};
+    long size = sysconf(NAMES[level - 1]);
+    if (size > 0) {
+        return size;
+    }
+#endif
+    for (int index = 0; index < 8; index++) {
+        char path[64], type[16] = "", unit = 'K';
+        int found_level = 0;
+        long size = 0;
+        FILE *file;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        if (NULL != (file = fopen(path, "r"))) {
+            found_level = (1 == fscanf(file, "%d", &found_level)) ? found_level : 0;
+            fclose(file);
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        if (NULL != (file = fopen(path, "r"))) {
+            found_level = (1 == fscanf(file, "%15s", type) && 0 != strcmp(type, "Instruction")) ? found_level : 0;
+            fclose(file);
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        if (found_level == level && NULL != (file = fopen(path, "r"))) {
+            if (1 > fscanf(file, "%ld%c", &size, &unit)) {
+                size = 0;
+            }
+            fclose(file);
+            return size * (('M' == unit) ? 1024 * 1024 : ('K' == unit) ? 1024 : 1);
+        }
+    }
+    return 0;
+}
+
+// Chooses the tile size for blocks of halo_depth steps. Tiling only pays
+// when the two extended buffers don't fit in the L2 cache anyway. The
+// candidates are the tiles whose two scratch buffers fill a quarter, half
+// or all of L2, and each of them and the untiled loop is timed on a block
+// of the local buffers, which don't hold any data yet. There is no halo
+// exchange, so every rank can choose its own. Returns 0 for the untiled
+// loop.
+int choose_tile(struct domain *local, int halo_depth, int extent, stencil_kernel kernel, const double *stencil, int num_threads) {
+    const int LINE = STENCIL_ALIGNMENT / sizeof(double);
+    long l2 = cache_size(2);
+    if (l2 <= 0) {
+        l2 = 256 * 1024;
+    }
+    if (halo_depth < 2 || 2 * (long)(local->count + 2 * local->halo) * (long)sizeof(double) <= l2) {
+        return 0;
+    }
+
+    int best_tile = 0;
+    double best_time = 0;
+    for (int candidate = 0; candidate <= 3; candidate++) {
+        int tile = 0;
+        if (candidate > 0) {
+            long footprint = l2 >> (3 - candidate);
+            tile = (int)(footprint / (2 * (long)sizeof(double))) - 2 * local->halo - 2 * LINE;
+            tile = tile / LINE * LINE;
+            // Tiles narrower than the points they depend on mostly compute
+            // the same points again
+            if (tile < 4 * halo_depth * extent || tile >= local->count) {
+                continue;
+            }
+        }
+        double time = 0;
+        for (int trial = 0; trial < 2; trial++) {
+            double start = MPI_Wtime();
+#pragma omp parallel num_threads(num_threads)
+            {
+                if (tile > 0) {
+                    double *scratch = alloc_extended(2 * (tile + 2 * local->halo + 2 * LINE));
+                    apply_tiles(local, 0, halo_depth, extent, kernel, stencil, tile, scratch, 2);
+                    free(scratch);
+                } else {
+                    for (int t = 0; t < halo_depth; t++) {
+                        int first = (t + 1) * extent;
+                        apply_stencil_share(kernel, local->extended[t % 2], local->extended[1 - t % 2], first, local->count + 2 * local->halo - first,
+                                            stencil, extent);
+#pragma omp barrier
+                    }
+                }
+            }
+            double elapsed = MPI_Wtime() - start;
+            time = (0 == trial || elapsed < time) ? elapsed : time;
+        }
+        if (0 == candidate || time < best_time) {
+            best_tile = tile;
+            best_time = time;
+        }
+    }
+    return best_tile;
+}
+
+// Moves the slice boundaries towards a split in proportion to the speed
+// each rank measured over its last compute_time, if the slowest rank's
+// predicted step time is more than REBALANCE_TOLERANCE above the average.
+// A boundary moves by at most half of the smaller neighbouring slice minus
+// the halo, so points only move between neighbours and every slice still
+// covers a halo. Returns the imbalance (slowest over average step time)
+// that was corrected, or 0 if the slices were left alone.
+#define REBALANCE_TOLERANCE 0.05
+double rebalance(struct domain *local, int id, int procs, int *counts, int *displs, double compute_time) {
+    double *rates = malloc(procs * sizeof(double));
+    double rate = compute_time / local->count;
+    MPI_Allgather(&rate, 1, MPI_DOUBLE, rates, 1, MPI_DOUBLE, local->comm);
+
+    double max_time = 0, total_time = 0, total_speed = 0;
+    for (int r = 0; r < procs; r++) {
+        if (!(rates[r] > 0)) {
+            free(rates);
+            return 0;
+        }
+        double time = rates[r] * counts[r];
+        max_time = (time > max_time) ? time : max_time;
+        total_time += time;
+        total_speed += 1 / rates[r];
+    }
+    double imbalance = max_time * procs / total_time;
+    if (imbalance <= 1 + REBALANCE_TOLERANCE) {
+        free(rates);
+        return 0;
+    }
+
+    // Every rank computes the same new boundaries from the gathered rates
+    int *new_displs = malloc((procs + 1) * sizeof(int));
+    double prefix = 0;
+    new_displs[0] = 0;
+    new_displs[procs] = displs[procs];
+    for (int r = 1; r < procs; r++) {
+        prefix += 1 / rates[r - 1];
+        int target = (int)llround(displs[procs] * prefix / total_speed);
+        int smaller = (counts[r - 1] < counts[r]) ? counts[r - 1] : counts[r];
+        int limit = (smaller - local->halo) / 2;
+        int shift = target - displs[r];
+        if (limit < 0) {
+            limit = 0;
+        }
+        if (shift > limit) {
+            shift = limit;
+        } else if (shift < -limit) {
+            shift = -limit;
+        }
+        new_displs[r] = displs[r] + shift;
+    }
+    free(rates);
+
+    // The points that stay are copied, and the ones across a moved boundary
+    // come from or go to the neighbour on that side
+    int old_first = displs[id], old_last = displs[id + 1];
+    int first = new_displs[id], last = new_displs[id + 1];
+    struct domain moved;
+    setup_domain(&moved, id, procs, last - first, local->halo, local->exchange, local->comm);
+    const double *old_values = local->extended[local->current] + local->halo;
+    double *values = moved.extended[0] + moved.halo;
+    MPI_Request transfers[2];
+    int num_transfers = 0;
+    if (first < old_first) {
+        MPI_Irecv(values, old_first - first, MPI_DOUBLE, id - 1, 2, local->comm, &transfers[num_transfers++]);
+    } else if (first > old_first) {
+        MPI_Isend(old_values, first - old_first, MPI_DOUBLE, id - 1, 3, local->comm, &transfers[num_transfers++]);
+    }
+    if (last > old_last) {
+        MPI_Irecv(values + old_last - first, last - old_last, MPI_DOUBLE, id + 1, 3, local->comm, &transfers[num_transfers++]);
+    } else if (last < old_last) {
+        MPI_Isend(old_values + last - old_first, old_last - last, MPI_DOUBLE, id + 1, 2, local->comm, &transfers[num_transfers++]);
+    }
+    int kept_first = (first > old_first) ? first : old_first;
+    int kept_last = (last < old_last) ? last : old_last;
+    memcpy(values + kept_first - first, old_values + kept_first - old_first, (kept_last - kept_first) * sizeof(double));
+    MPI_Waitall(num_transfers, transfers, MPI_STATUSES_IGNORE);
+
+    moved.snapshots = local->snapshots;
+    free_domain(local);
+    *local = moved;
+    for (int r = 0; r < procs; r++) {
+        displs[r + 1] = new_displs[r + 1];
+        counts[r] = displs[r + 1] - displs[r];
+    }
+    free(new_displs);
+    return imbalance;
+}
+
+// The phases of a run whose time every rank accumulates. Compute is the
+// time of the stencil loop less the halo wait, the copies of points between
+// ranks when the slices are rebalanced and the copies into snapshots.
+enum phase { PHASE_READ, PHASE_SCATTER, PHASE_HALO_WAIT, PHASE_COMPUTE, PHASE_COPY, PHASE_SNAPSHOT, PHASE_GATHER, PHASE_WRITE, NUM_PHASES };
+const char *PHASE_NAMES[NUM_PHASES] = {"read", "scatter", "halo_wait", "compute", "copy", "snapshot", "gather", "write"};
+
+// Gathers the phase times of all ranks on the root process, which writes
+// them to a JSON file with their minimum, average and maximum per phase.
+// This is a collective operation. Returns 0 on success, -1 on error.
+int write_phase_report(const char *file_name, const double *times, int num_values, int num_steps, int num_threads, double elapsed, MPI_Comm comm) {
+    int id, procs;
+    MPI_Comm_rank(comm, &id);
+    MPI_Comm_size(comm, &procs);
+    double *all_times = (id == 0) ? malloc((size_t)procs * NUM_PHASES * sizeof(double)) : NULL;
+    MPI_Gather(times, NUM_PHASES, MPI_DOUBLE, all_times, NUM_PHASES, MPI_DOUBLE, 0, comm);
+    if (id != 0) {
+        return 0;
+    }
+    FILE *file = (NULL != all_times) ? fopen(file_name, "w") : NULL;
+    if (NULL == file) {
+        free(all_times);
+        return -1;
+    }
+    fprintf(file, "{\n  \"procs\": %d,\n  \"threads\": %d,\n  \"points\": %d,\n  \"steps\": %d,\n  \"elapsed\": %.9f,\n  \"phases\": {\n", procs,
+            num_threads, num_values, num_steps, elapsed);
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        double min = all_times[phase], max = all_times[phase], sum = 0;
+        for (int r = 0; r < procs; r++) {
+            double time = all_times[r * NUM_PHASES + phase];
+            min = (time < min) ? time : min;
+            max = (time > max) ? time : max;
+            sum += time;
+        }
+        fprintf(file, "    \"%s\": {\"min\": %.9f, \"avg\": %.9f, \"max\": %.9f, \"ranks\": [", PHASE_NAMES[phase], min, sum / procs, max);
+        for (int r = 0; r < procs; r++) {
+            fprintf(file, "%s%.9f", (r > 0) ? ", " : "", all_times[r * NUM_PHASES + phase]);
+        }
+        fprintf(file, "]}%s\n", (phase < NUM_PHASES - 1) ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+    free(all_times);
+    return (0 == fclose(file)) ? 0 : -1;
+}
+
+// Reads a comma separated list of positive integers. Returns the array,
+// which the caller frees, or NULL on error.
+int *parse_int_list(const char *list, int *count) {
+    *count = 1;
+    for (const char *c = list; *c; c++) {
+        *count += (',' == *c);
+    }
+    int *values = malloc(*count * sizeof(int));
+    const char *next = list;
+    for (int i = 0; i < *count && NULL != values; i++) {
+        char *end;
+        long value = strtol(next, &end, 10);
+        if (end == next || value < 1 || value > INT_MAX || (',' != *end && '\0' != *end)) {
+            free(values);
+            return NULL;
+        }
+        values[i] = (int)value;
+        next = end + 1;
+    }
+    return values;
+}
+
+// Runs num_steps steps of the loop over num_values points of sin(x), which
+// every process of comm generates in its own slice, so nothing is read or
+// scattered. The result is compared with sin(x + num_steps * derivative *
+// PI / 2), the exact derivative. errors gets the largest deviation, the
+// bound on the truncation error of the stencil and a bound on the rounding
+// errors. Returns the time of the slowest process, or -1 if the slices are
+// too small for the stencil. This is a collective operation.
+double bench_run(MPI_Comm comm, int num_values, int num_steps, const char *coefficient_list, int stencil_width, int derivative, const char *simd,
+                 int halo_depth, int num_threads, enum exchange exchange, int tile, double errors[3]) {
+    int id, procs;
+    MPI_Comm_rank(comm, &id);
+    MPI_Comm_size(comm, &procs);
+    double h = 2.0 * PI / num_values;
+    double *stencil;
+    int width = make_stencil(coefficient_list, stencil_width, derivative, h, &stencil);
+    stencil_kernel kernel = select_stencil_kernel(width, simd, NULL);
+    const int EXTENT = width / 2;
+    if (NULL == kernel || num_values / procs < EXTENT) {
+        free(stencil);
+        return -1;
+    }
+
+    double *weights = malloc(procs * sizeof(double));
+    int *counts = malloc(procs * sizeof(int));
+    int *displs = malloc((procs + 1) * sizeof(int));
+    for (int r = 0; r < procs; r++) {
+        weights[r] = 1;
+    }
+    partition(num_values, procs, weights, counts, displs);
+    if (halo_depth <= 0) {
+        halo_depth = choose_halo_depth(id, procs, EXTENT, counts[id], num_threads, kernel, stencil, comm);
+    }
+    if (halo_depth > num_values / procs / EXTENT) {
+        halo_depth = num_values / procs / EXTENT;
+    }
+    if (halo_depth < 1) {
+        halo_depth = 1;
+    }
+    struct domain local;
+    setup_domain(&local, id, procs, counts[id], halo_depth * EXTENT, exchange, comm);
+    if (tile < 0) {
+        tile = choose_tile(&local, halo_depth, EXTENT, kernel, stencil, num_threads);
+    }
+    double *values = local.extended[local.current] + local.halo;
+    for (int i = 0; i < local.count; i++) {
+        values[i] = sin(h * (displs[id] + i));
+    }
+
+    double interior_time = 0, wait_time = 0;
+    MPI_Barrier(comm);
+    double start = MPI_Wtime();
+    run_steps(&local, num_steps, halo_depth, EXTENT, kernel, stencil, num_threads, tile, &interior_time, &wait_time);
+    double time = MPI_Wtime() - start;
+
+    // Applied to e^ix the stencil gives lambda e^ix, so the steps give the
+    // imaginary part of lambda^num_steps e^ix, and the truncation error of
+    // sin is at most |lambda^num_steps - i^(num_steps * derivative)|. Every
+    // step adds rounding errors of about width * DBL_EPSILON times the sum
+    // of the absolute coefficients, and multiplies the earlier ones by up to
+    // that sum.
+    double re = 0, im = 0, norm = 0;
+    for (int j = 0; j < width; j++) {
+        re += stencil[j] * cos((j - EXTENT) * h);
+        im += stencil[j] * sin((j - EXTENT) * h);
+        norm += fabs(stencil[j]);
+    }
+    double magnitude = pow(hypot(re, im), num_steps), angle = num_steps * atan2(im, re), exact_angle = num_steps * derivative * PI / 2;
+    double local_errors[3] = {0, hypot(magnitude * cos(angle) - cos(exact_angle), magnitude * sin(angle) - sin(exact_angle)),
+                              width * DBL_EPSILON * (num_steps + 1) * pow(norm > 1 ? norm : 1, num_steps)};
+    values = local.extended[local.current] + local.halo;
+    for (int i = 0; i < local.count; i++) {
+        double error = fabs(values[i] - sin(h * (displs[id] + i) + exact_angle));
+        local_errors[0] = (error > local_errors[0] || error != error) ? (error == error ? error : INFINITY) : local_errors[0];
+    }
+    MPI_Allreduce(local_errors, errors, 3, MPI_DOUBLE, MPI_MAX, comm);
+    double max_time;
+    MPI_Allreduce(&time, &max_time, 1, MPI_DOUBLE, MPI_MAX, comm);
+
+    free_domain(&local);
+    free(weights);
+    free(counts);
+    free(displs);
+    free(stencil);
+    return max_time;
+}
+
+// Benchmark mode. For every process count, the first that many processes
+// run bench_run for every combination of the point and step counts, with
+// the points per process instead of the total with per_process (weak
+// scaling). The root process appends a line per run to the CSV file. The
+// efficiency is the throughput per process relative to the first process
+// count of the list that ran the same point and step counts, which is the
+// speedup over the process ratio for a fixed size and the inverse time
+// ratio for a fixed size per process. Returns the number of runs whose
+// error exceeded what truncation and rounding account for. Runs where that
+// is BENCH_MAX_TOLERANCE or more aren't counted.
+#define BENCH_MAX_TOLERANCE 0.01
+int run_benchmark(const char *csv_name, const int *points, int num_points, const int *steps, int num_step_counts, const int *procs, int num_procs,
+                  int per_process, const char *coefficient_list, int stencil_width, int derivative, const char *simd, int halo_depth, int num_threads,
+                  enum exchange exchange, int tile) {
+    int id, world_procs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &id);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_procs);
+    FILE *csv = NULL;
+    if (id == 0) {
+        if (NULL == (csv = fopen(csv_name, "a"))) {
+            perror("Couldn't open CSV file");
+        } else if (0 == ftell(csv)) {
+            fprintf(csv, "procs,points,steps,time,points_per_s,gb_per_s,efficiency,error\n");
+        }
+    }
+    int failures = 0;
+    double *base_rates = calloc(num_points * num_step_counts, sizeof(double));
+    for (int n = 0; n < num_procs; n++) {
+        if (procs[n] > world_procs) {
+            if (id == 0) {
+                fprintf(stderr, "Skipping %d processes, there are only %d\n", procs[n], world_procs);
+            }
+            continue;
+        }
+        MPI_Comm comm;
+        MPI_Comm_split(MPI_COMM_WORLD, (id < procs[n]) ? 0 : MPI_UNDEFINED, id, &comm);
+        for (int p = 0; p < num_points && MPI_COMM_NULL != comm; p++) {
+            for (int s = 0; s < num_step_counts; s++) {
+                long long num_values = per_process ? (long long)points[p] * procs[n] : points[p];
+                if (num_values > INT_MAX) {
+                    continue;
+                }
+                double errors[3];
+                double time = bench_run(comm, (int)num_values, steps[s], coefficient_list, stencil_width, derivative, simd, halo_depth, num_threads,
+                                        exchange, tile, errors);
+                if (id != 0) {
+                    continue;
+                }
+                if (time < 0) {
+                    fprintf(stderr, "Skipping %lld points on %d processes, which is too few for the stencil\n", num_values, procs[n]);
+                    continue;
+                }
+                double rate = num_values * (double)steps[s] / (time > 0 ? time : 1e-9);
+                double *base_rate = &base_rates[p * num_step_counts + s];
+                if (0 == *base_rate) {
+                    *base_rate = rate / procs[n];
+                }
+                // A derivative stencil amplifies the rounding errors in every
+                // step, so on a fine grid the result is noise after a few
+                // steps, and those runs can't be checked
+                double tolerance = 2 * errors[1] + errors[2];
+                int checked = tolerance < BENCH_MAX_TOLERANCE;
+                int verified = errors[0] <= tolerance;
+                failures += checked && !verified;
+                printf("%d processes, %lld points, %d steps: %f s, %.4g points/s, error %.3g%s\n", procs[n], num_values, steps[s], time, rate, errors[0],
+                       !checked ? " (not checked, rounding errors dominate)" : verified ? "" : " (FAILED)");
+                if (NULL != csv) {
+                    fprintf(csv, "%d,%lld,%d,%f,%.6g,%.6g,%.4f,%.3g\n", procs[n], num_values, steps[s], time, rate, rate * 2 * sizeof(double) * 1e-9,
+                            rate / procs[n] / *base_rate, errors[0]);
+                }
+            }
+        }
+        if (MPI_COMM_NULL != comm) {
+            MPI_Comm_free(&comm);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    free(base_rates);
+    if (NULL != csv) {
+        fclose(csv);
+    }
+    MPI_Bcast(&failures, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return failures;
+}
+
+// Batch mode. The batch file lists an input and an output file per line,
+// for signals of the same length, which the root process reads. All
+// signals go through the loop together, interleaved, so that one halo
+// exchange carries the ghost points of every signal and the batch kernel
+// vectorizes across them. The domain holds values rather than points,
+// and the extent and halo are scaled by the number of signals. Returns 0
+// on success. This is a collective operation.
+int run_batch(const char *batch_name, int num_steps, const char *coefficient_list, int stencil_width, int derivative, int halo_depth, int num_threads,
+              enum exchange exchange, int tile) {
+    const int MAX_PATH = 4096;
+    int id, procs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &id);
+    MPI_Comm_size(MPI_COMM_WORLD, &procs);
+    double start = MPI_Wtime();
+
+    // The file names and signals are only needed on the root process
+    int num_signals = 0, num_values = 0;
+    char (*output_names)[MAX_PATH] = NULL;
+    double *interleaved = NULL;
+    if (id == 0) {
+        FILE *file = fopen(batch_name, "r");
+        char input_name[MAX_PATH], output_name[MAX_PATH];
+        double **signals = NULL;
+        while (NULL != file && 2 == fscanf(file, "%4095s %4095s", input_name, output_name)) {
+            double *values;
+            int count = read_input(input_name, &values);
+            if (count < 0 || (num_signals > 0 && count != num_values)) {
+                fprintf(stderr, "%s: the signals must be readable and of the same length\n", input_name);
+                num_values = -1;
+                if (count >= 0) {
+                    free(values);
+                }
+                break;
+            }
+            num_values = count;
+            signals = realloc(signals, (num_signals + 1) * sizeof(double *));
+            output_names = realloc(output_names, (num_signals + 1) * sizeof(*output_names));
+            signals[num_signals] = values;
+            strcpy(output_names[num_signals++], output_name);
+        }
+        if (NULL == file) {
+            perror("Couldn't open batch file");
+            num_values = -1;
+        } else {
+            fclose(file);
+        }
+        if (num_values > 0 && NULL != (interleaved = malloc((size_t)num_values * num_signals * sizeof(double)))) {
+            for (int i = 0; i < num_values; i++) {
+                for (int k = 0; k < num_signals; k++) {
+                    interleaved[(size_t)i * num_signals + k] = signals[k][i];
+                }
+            }
+        }
+        for (int k = 0; k < num_signals; k++) {
+            free(signals[k]);
+        }
+        free(signals);
+    }
+    int sizes[2] = {num_signals, num_values};
+    MPI_Bcast(sizes, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    num_signals = sizes[0];
+    num_values = sizes[1];
+    double h = 2.0 * PI / num_values;
+    double *stencil = NULL;
+    int width = (num_values > 0) ? make_stencil(coefficient_list, stencil_width, derivative, h, &stencil) : 0;
+    stencil_kernel kernel = select_batch_kernel(width);
+    const int EXTENT = width / 2;
+    if (num_signals < 1 || num_values < 1 || NULL == kernel || num_values / procs < EXTENT ||
+        (long long)num_values * num_signals > INT_MAX) {
+        if (id == 0 && num_values >= 0) {
+            fprintf(stderr, "Invalid batch: it needs signals of at least %d values per process, of at most %d values together, and a stencil of width 3, 5, 7, 9, 13, 17, 21 or 25\n",
+                    EXTENT, INT_MAX);
+        }
+        free(stencil);
+        free(interleaved);
+        free(output_names);
+        return 2;
+    }
+
+    // The slices are split between points, so each process gets all signals
+    // of its points
+    double *weights = malloc(procs * sizeof(double));
+    int *counts = malloc(procs * sizeof(int));
+    int *displs = malloc((procs + 1) * sizeof(int));
+    for (int r = 0; r < procs; r++) {
+        weights[r] = 1;
+    }
+    partition(num_values, procs, weights, counts, displs);
+    for (int r = 0; r <= procs; r++) {
+        if (r < procs) {
+            counts[r] *= num_signals;
+        }
+        displs[r] *= num_signals;
+    }
+    const int VALUE_EXTENT = EXTENT * num_signals;
+    if (halo_depth <= 0) {
+        halo_depth = choose_halo_depth(id, procs, VALUE_EXTENT, counts[id], num_threads, kernel, stencil, MPI_COMM_WORLD);
+    }
+    if (halo_depth > num_values / procs / EXTENT) {
+        halo_depth = num_values / procs / EXTENT;
+    }
+    if (halo_depth < 1) {
+        halo_depth = 1;
+    }
+    struct domain local;
+    setup_domain(&local, id, procs, counts[id], halo_depth * VALUE_EXTENT, exchange, MPI_COMM_WORLD);
+    if (tile < 0) {
+        tile = choose_tile(&local, halo_depth, VALUE_EXTENT, kernel, stencil, num_threads);
+    }
+    MPI_Scatterv(interleaved, counts, displs, MPI_DOUBLE, local.extended[local.current] + local.halo, counts[id], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    double interior_time = 0, wait_time = 0;
+    MPI_Barrier(MPI_COMM_WORLD);
+    double loop_start = MPI_Wtime();
+    run_steps(&local, num_steps, halo_depth, VALUE_EXTENT, kernel, stencil, num_threads, tile, &interior_time, &wait_time);
+    double loop_time = MPI_Wtime() - loop_start, max_loop_time;
+    MPI_Reduce(&loop_time, &max_loop_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    MPI_Gatherv(local.extended[local.current] + local.halo, local.count, MPI_DOUBLE, interleaved, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    int status = 0;
+    if (id == 0) {
+        double *output = malloc(num_values * sizeof(double));
+        for (int k = 0; k < num_signals && NULL != output; k++) {
+            for (int i = 0; i < num_values; i++) {
+                output[i] = interleaved[(size_t)i * num_signals + k];
+            }
+            if (0 != write_output(output_names[k], output, num_values)) {
+                fprintf(stderr, "Failed to write %s\n", output_names[k]);
+                status = 2;
+            }
+        }
+        free(output);
+        double total_time = MPI_Wtime() - start;
+        printf("%f\n", max_loop_time);
+        fprintf(stderr, "signals: %d, halo depth: %d, tile: %d, signals per second: %.1f in the loop, %.1f including input and output\n", num_signals,
+                halo_depth, tile, max_loop_time > 0 ? num_signals / max_loop_time : 0.0, total_time > 0 ? num_signals / total_time : 0.0);
+    }
+
+    free_domain(&local);
+    free(weights);
+    free(counts);
+    free(displs);
+    free(stencil);
+    free(interleaved);
+    free(output_names);
+    return status;
+}
+
+// Fused sweeps are applied with the scalar kernels, which keep the stencil
+// and the window of input values in registers only up to about this width
+#define FUSION_MAX_WIDTH 25
+
 int main(int argc, char **argv) {
-    if (4 != argc) {
-        printf("Usage: stencil input_file output_file number_of_applications\n");
+    int halo_depth = 0;
+    int fusion = 1;
+    int tile = -1;
+    int num_threads = 1;
+    int stencil_width = 5, derivative = 1;
+    int rebalance_interval = 0;
+    int snapshot_interval = 0, restart = 0;
+    const char *coefficient_list = NULL;
+    const char *weight_list = NULL;
+    const char *output_format = "text";
+    const char *simd = NULL;
+    const char *engine = "auto";
+    const char *exchange_name = "msg";
+    const char *report_name = NULL;
+    // In benchmark mode the arguments are the CSV file and the lists of
+    // point and step counts, in batch mode the batch file and the number
+    // of steps
+    const int bench = argc > 1 && 0 == strcmp(argv[1], "-b");
+    const int batch = argc > 1 && 0 == strcmp(argv[1], "-m");
+    const char *procs_list = NULL;
+    int per_process = 0;
+    int bad_arguments = argc < 4 + bench;
+    for (int i = 4 + bench; i < argc && !bad_arguments; i++) {
+        if (0 == strcmp(argv[i], "-k") && i + 1 < argc) {
+            halo_depth = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-s") && i + 1 < argc) {
+            simd = argv[++i];
+        } else if (0 == strcmp(argv[i], "-t") && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-w") && i + 1 < argc) {
+            stencil_width = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-d") && i + 1 < argc) {
+            derivative = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-c") && i + 1 < argc) {
+            coefficient_list = argv[++i];
+        } else if (0 == strcmp(argv[i], "-W") && i + 1 < argc) {
+            weight_list = argv[++i];
+        } else if (0 == strcmp(argv[i], "-T") && i + 1 < argc) {
+            tile = (0 == strcmp(argv[++i], "auto")) ? -1 : atoi(argv[i]);
+        } else if (0 == strcmp(argv[i], "-f") && i + 1 < argc) {
+            fusion = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-r") && i + 1 < argc) {
+            rebalance_interval = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-S") && i + 1 < argc) {
+            snapshot_interval = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-R")) {
+            restart = 1;
+        } else if (0 == strcmp(argv[i], "-e") && i + 1 < argc) {
+            engine = argv[++i];
+            bad_arguments = strcmp(engine, "auto") && strcmp(engine, "direct") && strcmp(engine, "fft");
+        } else if (0 == strcmp(argv[i], "-x") && i + 1 < argc) {
+            exchange_name = argv[++i];
+            bad_arguments = strcmp(exchange_name, "msg") && strcmp(exchange_name, "shm") && strcmp(exchange_name, "rma");
+        } else if (bench && 0 == strcmp(argv[i], "-P") && i + 1 < argc) {
+            procs_list = argv[++i];
+        } else if (bench && 0 == strcmp(argv[i], "-p")) {
+            per_process = 1;
+        } else if (0 == strcmp(argv[i], "-j") && i + 1 < argc) {
+            report_name = argv[++i];
+        } else if (0 == strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_format = argv[++i];
+            bad_arguments = strcmp(output_format, "text") && strcmp(output_format, "gather") && strcmp(output_format, "binary");
+        } else {
+            bad_arguments = 1;
+        }
+    }
+    if (bad_arguments) {
+        printf("Usage: stencil input_file output_file number_of_applications [-k halo_depth] [-s generic|scalar|sse2|avx2|avx512] [-t threads] [-w width] [-d derivative] [-c c0,c1,...] [-f fusion] [-T auto|tile] [-W auto|w0,w1,...] [-r steps] [-S steps] [-R] [-e auto|direct|fft] [-x msg|shm|rma] [-o text|gather|binary] [-j report.json]\n");
+        printf("       stencil -b csv_file points,... number_of_applications,... [-P procs,...] [-p] [-k halo_depth] [-s kernel] [-t threads] [-w width] [-d derivative] [-c c0,c1,...] [-T auto|tile] [-x msg|shm|rma]\n");
+        printf("       stencil -m batch_file number_of_applications [-k halo_depth] [-t threads] [-w width] [-d derivative] [-c c0,c1,...] [-T auto|tile] [-x msg|shm|rma]\n");
         return 1;
     }
 
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (fusion < 1) {
+        fusion = 1;
+    }
+    enum exchange exchange = EXCHANGE_MSG;
+    if (0 == strcmp(exchange_name, "shm")) {
+        exchange = EXCHANGE_SHM;
+    } else if (0 == strcmp(exchange_name, "rma")) {
+        exchange = EXCHANGE_RMA;
+    }
+
     char *input_name = argv[1];
     char *output_name = argv[2];
     int num_steps = atoi(argv[3]);
 
-    MPI_Init(&argc, &argv);
+    // Only the master thread of each rank makes MPI calls
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
     int procs, id;
     MPI_Comm_size(MPI_COMM_WORLD, &procs);
     MPI_Comm_rank(MPI_COMM_WORLD, &id);
 
-    // Read input file on the root process
-    double *input = NULL;
-    int num_values = 0;
-        if (0 > (num_values = read_input(input_name, &input))) {
-                return 2;
+    if (batch) {
+        int status = run_batch(argv[2], atoi(argv[3]), coefficient_list, stencil_width, derivative, halo_depth, num_threads, exchange, tile);
+        MPI_Finalize();
+        return status;
+    }
+
+    if (bench) {
+        // By default the process counts double up to all processes
+        int num_points, num_step_counts, num_procs = 0;
+        int *points = parse_int_list(argv[3], &num_points);
+        int *steps = parse_int_list(argv[4], &num_step_counts);
+        int *procs_counts = (NULL != procs_list) ? parse_int_list(procs_list, &num_procs) : malloc((sizeof(int) * CHAR_BIT + 1) * sizeof(int));
+        if (NULL == procs_list && NULL != procs_counts) {
+            for (int p = 1; p < procs; p *= 2) {
+                procs_counts[num_procs++] = p;
+            }
+            procs_counts[num_procs++] = procs;
         }
+        int status = 1;
+        if (NULL == points || NULL == steps || NULL == procs_counts) {
+            if (id == 0) {
+                fprintf(stderr, "Invalid list: give comma separated positive integers\n");
+            }
+        } else {
+            status = run_benchmark(argv[2], points, num_points, steps, num_step_counts, procs_counts, num_procs, per_process, coefficient_list, stencil_width,
+                                   derivative, simd, halo_depth, num_threads, exchange, tile) ? 3 : 0;
+        }
+        free(points);
+        free(steps);
+        free(procs_counts);
+        MPI_Finalize();
+        return status;
+    }
 
-    // Broadcast the number of values to all processes
-    MPI_Bcast(&num_values, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    // The phase times are taken around whole phases, a few calls to
+    // MPI_Wtime per run, so they are always measured
+    double phase_times[NUM_PHASES] = {0};
+    double phase_start = MPI_Wtime();
 
-    // Calculate the number of elements each process will handle
-    int recv_count = num_values / procs;
+    // A binary input file is read in parallel further down, where each
+    // process reads its own part. A text file is read by the root process.
+    // With -R the newest complete snapshot takes the place of the input and
+    // only the remaining steps are applied.
+    MPI_File binary_input;
+    double *input = NULL;
+    int resume_slot = -1;
+    int64_t done_steps = 0;
+    int num_values = restart ? open_snapshot(output_name, MPI_COMM_WORLD, &binary_input, &resume_slot, &done_steps) : 0;
+    if (num_values > 0 && done_steps > num_steps) {
+        if (id == 0) {
+            fprintf(stderr, "The snapshot after %lld steps is past the requested steps\n", (long long)done_steps);
+        }
+        MPI_File_close(&binary_input);
+        num_values = 0;
+        resume_slot = -1;
+        done_steps = 0;
+    }
+    if (restart && id == 0) {
+        if (num_values > 0) {
+            fprintf(stderr, "resuming from the snapshot after %lld steps\n", (long long)done_steps);
+        } else {
+            fprintf(stderr, "no complete snapshot, starting from the input\n");
+        }
+    }
+    const int total_steps = num_steps;
+    num_steps -= (int)done_steps;
+    if (0 == num_values) {
+        num_values = open_binary_input(input_name, MPI_COMM_WORLD, &binary_input);
+    }
+    int binary = num_values > 0;
+    if (0 == num_values) {
+        if (id == 0) {
+            num_values = read_input(input_name, &input);
+        }
+        // Broadcast the number of values to all processes
+        MPI_Bcast(&num_values, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    phase_times[PHASE_READ] += MPI_Wtime() - phase_start;
+    if (0 > num_values) {
+        MPI_Finalize();
+        return 2;
+    }
 
-    double *input_MPI = malloc(recv_count * sizeof(double));
-    double *output_MPI = malloc(recv_count * sizeof(double));
-    double *output = malloc(num_values * sizeof(double));
-    
-    
+    // The stencil either has explicitly given coefficients, which are scaled
+    // by 1/h^derivative, or is the central difference of the given width
     double h = 2.0 * PI / num_values; 
-    const int STENCIL_WIDTH = 5;
-    const int EXTENT = STENCIL_WIDTH / 2;
-    const double STENCIL[] = {1.0/(12*h), -8.0/(12*h), 0.0, 8.0/(12*h), -1.0/(12*h)};
-    double *extended_input = malloc((recv_count + 2 * EXTENT) * sizeof(double));
-    memset(extended_input, 0, (recv_count + 2 * EXTENT) * sizeof(double));
+    double *STENCIL;
+    int STENCIL_WIDTH = make_stencil(coefficient_list, stencil_width, derivative, h, &STENCIL);
+    if (0 == STENCIL_WIDTH) {
+        if (id == 0) {
+            fprintf(stderr, "Invalid stencil: the width must be odd and at least 3, and larger than the derivative order\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    const int BASE_EXTENT = STENCIL_WIDTH / 2;
+    stencil_kernel base_kernel = select_stencil_kernel(STENCIL_WIDTH, simd, NULL);
+    if (NULL == base_kernel) {
+        if (id == 0) {
+            fprintf(stderr, "Stencil kernel %s is not available\n", simd);
+        }
+        MPI_Finalize();
+        return 1;
+    }
 
-    // Scatter the input data from the root process to all processes
-    MPI_Scatter(input, recv_count, MPI_DOUBLE, input_MPI, recv_count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    memcpy(extended_input + EXTENT, input_MPI, recv_count * sizeof(double));
+    // With -f every sweep of the loop applies the composition of fusion
+    // steps, so the values pass through memory once per fusion steps instead
+    // of every step. The composed stencil is fusion times wider, and so are
+    // the halos. Beyond FUSION_MAX_WIDTH points it costs more than the
+    // passes it saves, so the factor is reduced to stay within it.
+    int requested_fusion = fusion;
+    while (fusion > 1 && fusion * (STENCIL_WIDTH - 1) + 1 > FUSION_MAX_WIDTH) {
+        fusion--;
+    }
+    if (id == 0 && fusion < requested_fusion) {
+        fprintf(stderr, "Fusion factor reduced to %d to keep the stencil within %d points\n", fusion, FUSION_MAX_WIDTH);
+    }
+    const int SWEEP_WIDTH = fusion * (STENCIL_WIDTH - 1) + 1;
+    double *SWEEP_STENCIL = malloc(SWEEP_WIDTH * sizeof(double));
+    int composed = (NULL != SWEEP_STENCIL && SWEEP_WIDTH == compose_stencil(STENCIL, STENCIL_WIDTH, fusion, SWEEP_STENCIL));
+    MPI_Allreduce(MPI_IN_PLACE, &composed, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    if (!composed) {
+        if (id == 0) {
+            fprintf(stderr, "Couldn't compose the stencil: out of memory\n");
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    const int EXTENT = SWEEP_WIDTH / 2;
+    const char *kernel_name;
+    stencil_kernel kernel = select_stencil_kernel(SWEEP_WIDTH, simd, &kernel_name);
+    if (NULL == kernel) {
+        kernel = select_stencil_kernel(SWEEP_WIDTH, NULL, &kernel_name);
+    }
 
-    MPI_Request request[4];
-    setup_persistent_communications(id, procs, EXTENT, recv_count, input_MPI, extended_input, request);
+    // Every process gets a contiguous slice of the values in proportion to
+    // its weight. Without weights the slices are equal, and with -W auto
+    // the weights are the speeds measured on an equal share.
+    double *weights = malloc(procs * sizeof(double));
+    int *counts = malloc(procs * sizeof(int));
+    int *displs = malloc((procs + 1) * sizeof(int));
+    int bad_weights = 0;
+    if (NULL == weight_list) {
+        for (int r = 0; r < procs; r++) {
+            weights[r] = 1;
+        }
+    } else if (0 == strcmp(weight_list, "auto")) {
+        calibrate_weights(num_values / procs, EXTENT, num_threads, kernel, SWEEP_STENCIL, weights, MPI_COMM_WORLD);
+    } else {
+        bad_weights = parse_weights(weight_list, procs, weights);
+    }
+    if (!bad_weights) {
+        partition(num_values, procs, weights, counts, displs);
+        for (int r = 0; r < procs; r++) {
+            bad_weights |= counts[r] < EXTENT;
+        }
+    }
+    free(weights);
+    if (bad_weights) {
+        if (id == 0) {
+            fprintf(stderr, "Invalid weights: give one positive weight per process, and leave every process at least %d values\n", EXTENT);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    // Each exchange fills halo_depth * EXTENT ghost points per side, which
+    // is enough for halo_depth steps. The ghosts come from the neighbours'
+    // own points, so the halo cannot be wider than the smallest slice.
+    int min_count = counts[0];
+    for (int r = 1; r < procs; r++) {
+        min_count = (counts[r] < min_count) ? counts[r] : min_count;
+    }
+    // The spectral engine costs the same for any number of steps, so by
+    // default it takes over from the loop above the break-even step count
+    const int break_even = spectral_break_even(num_values, STENCIL_WIDTH);
+    const int spectral = (0 == strcmp(engine, "fft")) || (0 == strcmp(engine, "auto") && num_steps >= break_even);
+    if (spectral) {
+        halo_depth = 1;
+    }
+    if (halo_depth <= 0) {
+        halo_depth = choose_halo_depth(id, procs, EXTENT, counts[id], num_threads, kernel, SWEEP_STENCIL, MPI_COMM_WORLD);
+    }
+    if (halo_depth > min_count / EXTENT) {
+        halo_depth = min_count / EXTENT;
+    }
+    if (halo_depth < 1) {
+        halo_depth = 1;
+    }
+    const int HALO = halo_depth * EXTENT;
+
+    struct domain local;
+    setup_domain(&local, id, procs, counts[id], HALO, exchange, MPI_COMM_WORLD);
+
+    // Blocks of several steps over a slice that doesn't fit in the cache are
+    // applied in tiles that do, of a size found by trying a few
+    if (spectral) {
+        tile = 0;
+    } else if (tile < 0) {
+        tile = choose_tile(&local, halo_depth, EXTENT, kernel, SWEEP_STENCIL, num_threads);
+    }
+
+    phase_start = MPI_Wtime();
+    if (binary) {
+        if (0 != read_binary_input(&binary_input, displs[id], counts[id], local.extended[local.current] + HALO)) {
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        phase_times[PHASE_READ] += MPI_Wtime() - phase_start;
+    } else {
+        // Scatter the input data from the root process to all processes
+        MPI_Scatterv(input, counts, displs, MPI_DOUBLE, local.extended[local.current] + HALO, counts[id], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        phase_times[PHASE_SCATTER] += MPI_Wtime() - phase_start;
+    }
+
+    double interior_time = 0, wait_time = 0;
 
     // Start timer
     double local_start_time, local_elapsed_time, max_elapsed_time;
     MPI_Barrier(MPI_COMM_WORLD); 
     local_start_time = MPI_Wtime();
 
-    // Main loop for the stencil application
-    for (int s = 0; s < num_steps; s++) {
-
-        MPI_Startall(4, request);
-
-        MPI_Waitall(4, request, MPI_STATUSES_IGNORE);
-
-        // Apply stencil
-        for (int i = 0; i < recv_count; i++) {
-            double result = 0;
-            for (int j = -EXTENT; j <= EXTENT; j++) {
-                int index = i + EXTENT + j;
-                result += STENCIL[j + EXTENT] * extended_input[index];
+    // With -r the sweeps run in segments of whole halo blocks, and between
+    // segments the slice boundaries move if the ranks' compute times drifted
+    // apart. With -S a snapshot is taken every snapshot_interval steps,
+    // rounded up to whole sweeps, and written while the loop goes on.
+    if (spectral && 0 != spectral_apply(local.extended[local.current] + HALO, displs, STENCIL, STENCIL_WIDTH, num_steps, num_threads, MPI_COMM_WORLD)) {
+        if (id == 0) {
+            fprintf(stderr, "Not enough memory for the spectral engine\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    int num_sweeps = spectral ? 0 : num_steps / fusion, remainder = spectral ? 0 : num_steps % fusion;
+    int segment = num_sweeps, rebalances = 0;
+    if (rebalance_interval > 0) {
+        segment = ((rebalance_interval + fusion - 1) / fusion + halo_depth - 1) / halo_depth * halo_depth;
+    }
+    snapshot_writer snapshots;
+    int snapshot_sweeps = spectral ? 0 : (snapshot_interval + fusion - 1) / fusion;
+    if (spectral && snapshot_interval > 0 && id == 0) {
+        fprintf(stderr, "The fft engine applies all steps at once, so no snapshots are taken\n");
+    }
+    if (snapshot_sweeps > 0) {
+        if (0 != start_snapshots(&snapshots, output_name, num_values, resume_slot, MPI_COMM_WORLD)) {
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        local.snapshots = &snapshots;
+    }
+    double segment_start = MPI_Wtime(), segment_wait = wait_time;
+    for (int s = 0; s < num_sweeps;) {
+        int next = (s / segment + 1) * segment;
+        if (snapshot_sweeps > 0 && (s / snapshot_sweeps + 1) * snapshot_sweeps < next) {
+            next = (s / snapshot_sweeps + 1) * snapshot_sweeps;
+        }
+        next = (next < num_sweeps) ? next : num_sweeps;
+        run_steps(&local, next - s, halo_depth, EXTENT, kernel, SWEEP_STENCIL, num_threads, tile, &interior_time, &wait_time);
+        s = next;
+        if (s < num_sweeps && 0 == s % segment) {
+            double compute_time = MPI_Wtime() - segment_start - (wait_time - segment_wait);
+            double rebalance_start = MPI_Wtime();
+            double imbalance = rebalance(&local, id, procs, counts, displs, compute_time);
+            phase_times[PHASE_COPY] += MPI_Wtime() - rebalance_start;
+            if (imbalance > 0) {
+                rebalances++;
+                if (id == 0) {
+                    fprintf(stderr, "rebalanced after %lld steps, slowest rank was %.3f times the average\n", (long long)(done_steps + s * fusion),
+                            imbalance);
+                }
             }
-            output_MPI[i] = result;
+            segment_start = MPI_Wtime();
+            segment_wait = wait_time;
         }
-
-        // Swap input and output
-        if (s < num_steps - 1) {
-            memcpy(input_MPI, output_MPI, recv_count * sizeof(double));
-            memcpy(extended_input + EXTENT, input_MPI, recv_count * sizeof(double));
+        if (s < num_sweeps && snapshot_sweeps > 0 && 0 == s % snapshot_sweeps) {
+            double snapshot_start = MPI_Wtime();
+            write_snapshot(&snapshots, local.extended[local.current] + HALO, displs[id], local.count, done_steps + (int64_t)s * fusion);
+            phase_times[PHASE_SNAPSHOT] += MPI_Wtime() - snapshot_start;
         }
     }
 
+    // The steps left over from the last sweep are applied one at a time, and
+    // the halo is deep enough for all of them
+    if (remainder > 0) {
+        run_steps(&local, remainder, HALO / BASE_EXTENT, BASE_EXTENT, base_kernel, STENCIL, num_threads, tile, &interior_time, &wait_time);
+    }
 
     // Stop timer
     local_elapsed_time = MPI_Wtime() - local_start_time;
+    phase_times[PHASE_HALO_WAIT] = wait_time;
+    phase_times[PHASE_COMPUTE] = local_elapsed_time - wait_time - phase_times[PHASE_COPY] - phase_times[PHASE_SNAPSHOT];
+
+    // The last snapshot may still be in flight
+    if (snapshot_sweeps > 0) {
+        double snapshot_start = MPI_Wtime();
+        local.snapshots = NULL;
+        finish_snapshots(&snapshots);
+        phase_times[PHASE_SNAPSHOT] += MPI_Wtime() - snapshot_start;
+    }
     MPI_Reduce(&local_elapsed_time, &max_elapsed_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 
-    // Gather the processed data from all processes to the root process
-    MPI_Gather(output_MPI, recv_count, MPI_DOUBLE, output, recv_count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    // A step's messages are in flight from MPI_Startall until MPI_Waitall
+    // returns, and the part of that window spent on interior points is hidden.
+    double overlap_times[2] = {interior_time, wait_time}, total_overlap_times[2];
+    MPI_Reduce(overlap_times, total_overlap_times, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
 
-    // Root process writes the result to the output file and prints the execution time
+    // Root process prints the execution time
     if (id == 0) {
         printf("%f\n", max_elapsed_time);
-        if (0 != write_output(output_name, output, num_values)) {
-            fprintf(stderr, "Failed to write output\n");
+        double in_flight_time = total_overlap_times[0] + total_overlap_times[1];
+        if (spectral) {
+            fprintf(stderr, "engine: fft, threads: %d, break-even: %d steps\n", num_threads, break_even);
+        } else {
+            fprintf(stderr, "kernel: %s, threads: %d, exchange: %s, halo depth: %d, tile: %d, hidden communication fraction: %.3f", kernel_name, num_threads,
+                    exchange_name, halo_depth, tile,
+                    in_flight_time > 0 ? total_overlap_times[0] / in_flight_time : 0.0);
+            if (rebalance_interval > 0) {
+                fprintf(stderr, ", rebalances: %d", rebalances);
+            }
+            if (snapshot_sweeps > 0) {
+                fprintf(stderr, ", last snapshot: %lld steps", (long long)snapshots.completed);
+            }
+            fprintf(stderr, "\n");
+
+            // The effective rate counts the operations of the step by step loop,
+            // and the memory traffic assumes that every pass reads and writes
+            // each value once
+            double passes = num_sweeps + remainder;
+            fprintf(stderr, "fusion: %d, sweep stencil width: %d, effective GFLOP/s: %.3f, bytes per point per step: %.1f\n", fusion, SWEEP_WIDTH,
+                    max_elapsed_time > 0 ? 2.0 * STENCIL_WIDTH * num_values * num_steps / max_elapsed_time * 1e-9 : 0.0,
+                    num_steps > 0 ? 2 * sizeof(double) * passes / num_steps : 0.0);
         }
         free(input);
-        free(output);
     }
 
-    free(input_MPI);
-    free(output_MPI);
-    free(extended_input);
+    // By default every process writes its own part of the text output. The
+    // gather format collects all values on the root process, which writes
+    // the file alone.
+    const double *result = local.extended[local.current] + HALO;
+    int write_status = 0;
+    phase_start = MPI_Wtime();
+    if (0 == strcmp(output_format, "gather")) {
+        double *output = (id == 0) ? malloc(num_values * sizeof(double)) : NULL;
+        phase_start = MPI_Wtime();
+        MPI_Gatherv(result, local.count, MPI_DOUBLE, output, counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        phase_times[PHASE_GATHER] += MPI_Wtime() - phase_start;
+        phase_start = MPI_Wtime();
+        if (id == 0) {
+            write_status = write_output(output_name, output, num_values);
+            free(output);
+        }
+    } else if (0 == strcmp(output_format, "binary")) {
+        write_status = write_binary_output(output_name, result, displs[id], local.count, num_values, total_steps, MPI_COMM_WORLD);
+    } else {
+        write_status = write_output_parallel(output_name, result, local.count, MPI_COMM_WORLD);
+    }
+    phase_times[PHASE_WRITE] += MPI_Wtime() - phase_start;
+    if (id == 0 && 0 != write_status) {
+        fprintf(stderr, "Failed to write output\n");
+    }
+    if (NULL != report_name && 0 != write_phase_report(report_name, phase_times, num_values, num_steps, num_threads, max_elapsed_time, MPI_COMM_WORLD)) {
+        fprintf(stderr, "Failed to write the phase report\n");
+    }
+
+    free_domain(&local);
+    free(counts);
+    free(displs);
+    free(STENCIL);
+    free(SWEEP_STENCIL);
 
     MPI_Finalize();
 
     return 0;
 }
-
-int read_input(const char *file_name, double **values) {
-        FILE *file;
-        if (NULL == (file = fopen(file_name, "r"))) {
-                perror("Couldn't open input file");
-                return -1;
-        }
-        int num_values;
-        if (EOF == fscanf(file, "%d", &num_values)) {
-                perror("Couldn't read element count from input file");
-                return -1;
-        }
-        if (NULL == (*values = malloc(num_values * sizeof(double)))) {
-                perror("Couldn't allocate memory for input");
-                return -1;
-        }
-        for (int i=0; i<num_values; i++) {
-                if (EOF == fscanf(file, "%lf", &((*values)[i]))) {
-                        perror("Couldn't read elements from input file");
-                        return -1;
-                }
-        }
-        if (0 != fclose(file)){
-                perror("Warning: couldn't close input file");
-        }
-        return num_values;
-}
-
-
-int write_output(char *file_name, const double *output, int num_values) {
-        FILE *file;
-        if (NULL == (file = fopen(file_name, "w"))) {
-                perror("Couldn't open output file");
-                return -1;
-        }
-        for (int i = 0; i < num_values; i++) {
-                if (0 > fprintf(file, "%.4f ", output[i])) {
-                        perror("Couldn't write to output file");
-                }
-        }
-        if (0 > fprintf(file, "\n")) {
-                perror("Couldn't write to output file");
-        }
-        if (0 != fclose(file)) {
-                perror("Warning: couldn't close output file");
-        }
-        return 0;
-}
\ No newline at end of file
@@ -16,6 +16,8 @@
 #define PI 3.14159265358979323846
 #define PRODUCE_OUTPUT_FILE
 
+#include <mpi.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -40,4 +42,260 @@ int read_input(const char *file_name, double **values);
  */
 int write_output(char *file_name, const double *output, int num_values);
 
+/**
+ * The binary file format starts with this header, followed by count values
+ * of value_size bytes each in native byte order. Binary input files are
+ * recognized by the magic string.
+ */
+#define STENCIL_MAGIC "STENCIL"
+typedef struct {
+	char magic[8];      /* STENCIL_MAGIC, including the terminating zero */
+	int64_t count;      /* Number of values */
+	int32_t value_size; /* Size of a value in bytes, sizeof(double) */
+	int32_t version;    /* Format version, currently 1 */
+	int64_t steps;      /* Number of stencil applications behind the values */
+} stencil_file_header;
+
+/**
+ * Open an input file on all processes of a communicator and check whether it
+ * is in the binary format. This is a collective operation.
+ * @param file_name Name of input file
+ * @param comm Communicator of the processes that read the file
+ * @param file Set to the opened file if it is a binary file
+ * @return The number of values in a binary file, 0 if the file is not a
+ * binary file (it is closed again), -1 on error
+ */
+int open_binary_input(const char *file_name, MPI_Comm comm, MPI_File *file);
+
+/**
+ * Read a contiguous part of the values of a binary file opened by
+ * open_binary_input, and close the file. This is a collective operation.
+ * @param file The file
+ * @param first Index of the first value to read
+ * @param count Number of values to read
+ * @param values Array of count elements where the values are to be stored
+ * @return 0 on success, -1 on error
+ */
+int read_binary_input(MPI_File *file, int first, int count, double *values);
+
+/**
+ * Write function data to a file in the same format as write_output, with
+ * each process writing its own, consecutive part of the values. This is a
+ * collective operation.
+ * @param file_name Name of output file
+ * @param values Function values of this process
+ * @param count Number of values of this process
+ * @param comm Communicator of the processes, ordered like the values
+ * @return 0 on success, -1 on error
+ */
+int write_output_parallel(const char *file_name, const double *values, int count, MPI_Comm comm);
+
+/**
+ * Write function data to a file in the binary format, with each process
+ * writing its own part of the values. This is a collective operation.
+ * @param file_name Name of output file
+ * @param values Function values of this process
+ * @param first Index of the first value of this process
+ * @param count Number of values of this process
+ * @param num_values Total number of values
+ * @param steps Number of stencil applications, stored in the header
+ * @param comm Communicator of the processes
+ * @return 0 on success, -1 on error
+ */
+int write_binary_output(const char *file_name, const double *values, int first, int count, int num_values, int steps, MPI_Comm comm);
+
+/**
+ * Open the newest complete snapshot written by a snapshot_writer for the
+ * given output file, to resume from it. This is a collective operation.
+ * @param output_name Name of the output file of the run
+ * @param comm Communicator of the processes that read the snapshot
+ * @param file Set to the opened snapshot, which is read with
+ * read_binary_input like a binary input file
+ * @param slot Set to the slot of the snapshot, 0 or 1
+ * @param steps Set to the number of stencil applications behind it
+ * @return The number of values in the snapshot, or 0 if there is no
+ * complete snapshot
+ */
+int open_snapshot(const char *output_name, MPI_Comm comm, MPI_File *file, int *slot, int64_t *steps);
+
+/**
+ * Snapshots of a distributed vector, written in the background while the
+ * computation goes on. They alternate between two slots, the files
+ * output_name.snap0 and output_name.snap1 in the binary format. Each
+ * process copies its part into a buffer and starts a nonblocking write of
+ * it; once the writes of all processes have completed, the root process
+ * writes the header, which marks the snapshot complete. The root process
+ * clears the magic of a slot's header before the parts are written to it,
+ * and a failed snapshot is retried in the same slot, so while a snapshot
+ * is in flight the other slot holds the last complete one, and a process
+ * has at most one snapshot in flight, so the memory is bounded by one copy
+ * of its part.
+ * The parts aren't synced to disk with MPI_File_sync before the header is
+ * written, because that is a blocking collective and the processes reach
+ * it at different iterations. The header therefore only orders the writes
+ * as seen within the MPI run: a snapshot is safe to resume from after the
+ * run ended or was killed, but a crash of a node or the file system may
+ * leave a header in a slot whose parts never reached the disk.
+ */
+typedef struct {
+	MPI_Comm comm;        /* Duplicate of the communicator, used for nothing else */
+	MPI_File file[2];
+	int slot;             /* Slot of the snapshot in flight or the next one */
+	int stage;            /* Stage of the snapshot in flight, 0 if there is none */
+	int ok;               /* Whether this process wrote its part */
+	int all_ok;           /* Whether all processes did, on the root process */
+	int num_values;
+	double *buffer;       /* Copy of this process's part */
+	int count;            /* Number of values in the buffer */
+	int capacity;         /* Number of values that fit in it */
+	int64_t steps;        /* Stencil applications behind the snapshot in flight */
+	int64_t marked;       /* Its steps once it is complete, -1 if it failed */
+	int64_t completed;    /* Steps of the newest complete snapshot, -1 if none */
+	int failed;           /* Number of snapshots that failed */
+	MPI_Request request;
+} snapshot_writer;
+
+/**
+ * Open the two snapshot slots for an output file. The first snapshot is
+ * written to the slot that doesn't hold the snapshot a run resumed from.
+ * On a new run both slots are emptied. This is a collective operation.
+ * @param writer The writer
+ * @param output_name Name of the output file of the run
+ * @param num_values Total number of values
+ * @param resume_slot Slot of the snapshot the run resumed from, or -1
+ * @param comm Communicator of the processes
+ * @return 0 on success, -1 on error
+ */
+int start_snapshots(snapshot_writer *writer, const char *output_name, int num_values, int resume_slot, MPI_Comm comm);
+
+/**
+ * Take a snapshot of the values and start writing it. If the previous
+ * snapshot is still in flight, it is completed first. All processes must
+ * take the same snapshots.
+ * @param writer The writer
+ * @param values Function values of this process
+ * @param first Index of the first value of this process
+ * @param count Number of values of this process
+ * @param steps Number of stencil applications behind the values
+ */
+void write_snapshot(snapshot_writer *writer, const double *values, int first, int count, int64_t steps);
+
+/**
+ * Advance the snapshot in flight as far as possible without waiting. It
+ * only advances in calls to this function, so call it regularly.
+ * @param writer The writer
+ */
+void progress_snapshot(snapshot_writer *writer);
+
+/**
+ * Complete the snapshot in flight and close the slots. This is a
+ * collective operation.
+ * @param writer The writer
+ * @return 0 if every snapshot was completed, -1 if any failed
+ */
+int finish_snapshots(snapshot_writer *writer);
+
+/**
+ * Longest text written for one value by write_output_parallel.
+ */
+#define FORMATTED_VALUE_MAX 330
+
+/**
+ * Signature of the stencil kernels. A kernel applies a stencil with
+ * 2*extent+1 coefficients to the points [first, last) of input and writes
+ * the results to the same positions of output. Point i reads
+ * input[i-extent] to input[i+extent].
+ */
+typedef void (*stencil_kernel)(const double *input, double *output, int first, int last, const double *stencil, int extent);
+
+/**
+ * Compute the coefficients of the central finite difference stencil of the
+ * given width for a derivative of the given order, on a grid with spacing h.
+ * The stencil has order of accuracy width-1-derivative (rounded up to even).
+ * @param derivative Order of the derivative
+ * @param width Number of coefficients, which must be odd and larger than the
+ * derivative order
+ * @param h Grid spacing
+ * @param stencil Array of width elements where the coefficients are stored
+ * @return 0 on success, -1 if no such stencil exists
+ */
+int stencil_coefficients(int derivative, int width, double h, double *stencil);
+
+/**
+ * Compose a stencil with itself. Applying the composed stencil once gives
+ * the same result as applying the stencil times times, because both are
+ * convolutions, so its coefficients are the times-fold convolution of the
+ * coefficients.
+ * @param stencil Coefficients of the stencil
+ * @param width Number of coefficients
+ * @param times Number of applications to compose, at least 1
+ * @param composed Array of times*(width-1)+1 elements where the coefficients
+ * of the composed stencil are stored
+ * @return The width of the composed stencil, or -1 if out of memory
+ */
+int compose_stencil(const double *stencil, int width, int times, double *composed);
+
+/**
+ * Apply a stencil steps times to a periodic vector that is distributed in
+ * contiguous parts, by transforming it with a distributed FFT, multiplying
+ * every Fourier coefficient by the stencil's eigenvalue to the power steps,
+ * and transforming back. This is a collective operation.
+ * @param values The part of the vector on this process, overwritten with
+ * the result
+ * @param displs Index of the first value of each process, and the length of
+ * the vector as the last of its size+1 elements
+ * @param stencil Coefficients of the stencil
+ * @param width Number of coefficients
+ * @param steps Number of applications
+ * @param num_threads Number of threads for the local transforms
+ * @param comm Communicator of the processes
+ * @return 0 on success, -1 if out of memory on any process
+ */
+int spectral_apply(double *values, const int *displs, const double *stencil, int width, int steps, int num_threads, MPI_Comm comm);
+
+/**
+ * Estimate the number of steps above which spectral_apply is faster than
+ * applying the stencil step by step.
+ * @param num_values Length of the vector
+ * @param width Number of coefficients of the stencil
+ * @return The break-even number of steps
+ */
+int spectral_break_even(int num_values, int width);
+
+/**
+ * Generic reference kernel, which handles any stencil width.
+ */
+void apply_stencil(const double *input, double *output, int first, int last, const double *stencil, int extent);
+
+/**
+ * Select a kernel for a stencil of the given width. Widths 3, 5, 7, 9,
+ * 13, 17, 21 and 25 have unrolled kernels, and width 5 also has vectorized kernels,
+ * which are only used if the CPU supports them.
+ * @param width Number of stencil coefficients
+ * @param simd Name of the kernel to use ("generic", "scalar", "sse2", "avx2"
+ * or "avx512"), or NULL for the fastest one available
+ * @param name If not NULL, set to the name of the selected kernel
+ * @return The kernel, or NULL if the requested one is not available
+ */
+stencil_kernel select_stencil_kernel(int width, const char *simd, const char **name);
+
+/**
+ * Select a kernel for signals stored interleaved, the values of all signals
+ * at a point next to each other. The kernel applies a stencil of the given
+ * width to every signal, with the extent argument given in values, the
+ * stencil extent times the number of signals, so value i reads the values
+ * of the same signal at i-extent to i+extent. The loop over the values of a
+ * point vectorizes across the signals. Only widths 3, 5, 7, 9, 13, 17, 21
+ * and 25 have batch kernels.
+ * @param width Number of stencil coefficients
+ * @return The kernel, or NULL if there is none for the width
+ */
+stencil_kernel select_batch_kernel(int width);
+
+/**
+ * Alignment in bytes of the stencil buffers, which lets the vectorized
+ * kernels use aligned stores.
+ */
+#define STENCIL_ALIGNMENT 64
+
 #endif /* _ASSIGNMENT1_STENCIL_H_ */
@@ -0,0 +1,50 @@
+/**
+ * Converts a stencil input file from the text format to the binary format,
+ * which the stencil program reads in parallel with MPI-IO. The program takes
+ * 2 arguments:
+ * - the path to the text input file.
+ * - the path to the binary output file. Note that this file will be
+ *   overwritten!
+ */
+
+#include "stencil.h"
+#include <string.h>
+
+
+int main(int argc, char **argv) {
+	if (3 != argc) {
+		printf("Usage: stencil_convert text_input_file binary_output_file\n");
+		return 1;
+	}
+
+	double *values;
+	int num_values;
+	if (0 > (num_values = read_input(argv[1], &values))) {
+		return 2;
+	}
+
+	stencil_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STENCIL_MAGIC, sizeof(STENCIL_MAGIC));
+	header.count = num_values;
+	header.value_size = sizeof(double);
+	header.version = 1;
+
+	FILE *file;
+	if (NULL == (file = fopen(argv[2], "wb"))) {
+		perror("Couldn't open output file");
+		return 2;
+	}
+	if (1 != fwrite(&header, sizeof(header), 1, file) ||
+	    (size_t)num_values != fwrite(values, sizeof(double), num_values, file)) {
+		perror("Couldn't write to output file");
+		return 2;
+	}
+	if (0 != fclose(file)) {
+		perror("Couldn't close output file");
+		return 2;
+	}
+
+	free(values);
+	return 0;
+}
@@ -0,0 +1,482 @@
+/**
+ * Spectral engine. A stencil on a periodic vector is a circulant operator,
+ * which the discrete Fourier transform diagonalizes, so applying it steps
+ * times is a multiplication of every Fourier coefficient by the stencil's
+ * eigenvalue to the power steps. The transform of the distributed vector is
+ * a four-step FFT: the n values are viewed as an n1 x n2 matrix, the n2
+ * columns of length n1 are transformed, multiplied by twiddle factors, and
+ * then the n1 rows of length n2 are transformed, with an all-to-all
+ * transpose in between so that every transform is local. Lengths with a
+ * prime factor above 7 are transformed with Bluestein's algorithm.
+ */
+
+#include "stencil.h"
+#include <complex.h>
+#include <math.h>
+#include <string.h>
+
+typedef double complex cplx;
+
+// Complex product without the checks for infinities that the C99 operator
+// does in a library call
+static inline cplx cmul(cplx a, cplx b) {
+	double re = creal(a) * creal(b) - cimag(a) * cimag(b);
+	double im = creal(a) * cimag(b) + cimag(a) * creal(b);
+	return re + im * I;
+}
+
+// exp(-2 PI i numerator / denominator), with the numerator reduced first so
+// that the angle is accurate for large products
+static cplx root_of_unity(long long numerator, long long denominator) {
+	double angle = -2.0 * PI * (double)(numerator % denominator) / (double)denominator;
+	return cos(angle) + sin(angle) * I;
+}
+
+// exp(-2 PI i a / n) for any a, as the product of two entries from tables
+// of about sqrt(n) entries each, which is as accurate as computing it
+// directly and much faster
+struct twiddle_table {
+	long long n;
+	int block;
+	cplx *coarse;     // exp(-2 PI i j block / n)
+	cplx *fine;       // exp(-2 PI i j / n) for j < block
+};
+
+static int twiddle_table_create(struct twiddle_table *table, long long n) {
+	table->n = n;
+	table->block = (int)sqrt((double)n) + 1;
+	long long coarse_count = n / table->block + 1;
+	table->coarse = malloc(coarse_count * sizeof(cplx));
+	table->fine = malloc(table->block * sizeof(cplx));
+	if (NULL == table->coarse || NULL == table->fine) {
+		return -1;
+	}
+	for (long long j = 0; j < coarse_count; j++) {
+		table->coarse[j] = root_of_unity(j * table->block, n);
+	}
+	for (int j = 0; j < table->block; j++) {
+		table->fine[j] = root_of_unity(j, n);
+	}
+	return 0;
+}
+
+static void twiddle_table_free(struct twiddle_table *table) {
+	free(table->coarse);
+	free(table->fine);
+}
+
+static inline cplx twiddle(const struct twiddle_table *table, long long a) {
+	a %= table->n;
+	if (a < 0) {
+		a += table->n;
+	}
+	return cmul(table->coarse[a / table->block], table->fine[a % table->block]);
+}
+
+// A transform of length n. Lengths whose prime factors are at most 7 are
+// split into radix 4, 2, 3, 5 and 7 stages. Any other length is a cyclic
+// convolution with a chirp of length m, a power of two of at least 2n - 1,
+// which is transformed the same way.
+#define MAX_RADICES 64
+struct fft_plan {
+	int n;
+	int m;
+	int radices[MAX_RADICES];
+	int num_radices;
+	cplx *roots;      // exp(-2 PI i j / m) for j < m
+	cplx *chirp;      // exp(-PI i j^2 / n) for j < n, for Bluestein only
+	cplx *chirp_fft;  // transform of the conjugate chirp, scaled by 1/m
+};
+
+// Stockham transform of x of length n, in stages that each take one radix r
+// off the remaining length and leave the result in natural order. Stage
+// inputs and outputs alternate between x and work, and the result ends up
+// in x.
+static void fft_stockham(cplx *x, cplx *work, int n, const int *radices, int num_radices, const cplx *roots) {
+	cplx *in = x, *out = work;
+	int length = n, stride = 1;
+	for (int stage = 0; stage < num_radices; stage++) {
+		const int r = radices[stage], m = length / r;
+		cplx unit[7];
+		for (int k = 0; k < r; k++) {
+			unit[k] = roots[k * (n / r)];
+		}
+		for (int p = 0; p < m; p++) {
+			// The twiddle factors exp(-2 PI i j p / length) are the same for
+			// every q, and j p stride stays below n
+			cplx factors[7];
+			for (int j = 0; j < r; j++) {
+				factors[j] = roots[j * p * stride];
+			}
+			for (int q = 0; q < stride; q++) {
+				cplx a[7], b[7];
+				for (int k = 0; k < r; k++) {
+					a[k] = in[q + stride * (p + k * m)];
+				}
+				if (2 == r) {
+					b[0] = a[0] + a[1];
+					b[1] = a[0] - a[1];
+				} else if (4 == r) {
+					cplx t0 = a[0] + a[2], t1 = a[0] - a[2], t2 = a[1] + a[3];
+					cplx t3 = (cimag(a[1]) - cimag(a[3])) - (creal(a[1]) - creal(a[3])) * I;
+					b[0] = t0 + t2;
+					b[1] = t1 + t3;
+					b[2] = t0 - t2;
+					b[3] = t1 - t3;
+				} else {
+					for (int j = 0; j < r; j++) {
+						b[j] = a[0];
+						for (int k = 1; k < r; k++) {
+							b[j] += cmul(a[k], unit[j * k % r]);
+						}
+					}
+				}
+				cplx *row = out + q + stride * r * p;
+				row[0] = b[0];
+				for (int j = 1; j < r; j++) {
+					row[stride * j] = cmul(b[j], factors[j]);
+				}
+			}
+		}
+		cplx *swap = in;
+		in = out;
+		out = swap;
+		length = m;
+		stride *= r;
+	}
+	if (in != x) {
+		memcpy(x, in, n * sizeof(cplx));
+	}
+}
+
+// Splits n into radices, returning their number, or 0 if n has a prime
+// factor above 7
+static int factor_radices(int n, int *radices) {
+	static const int RADICES[] = {4, 2, 3, 5, 7};
+	int count = 0;
+	for (int i = 0; i < 5; i++) {
+		while (n % RADICES[i] == 0 && count < MAX_RADICES) {
+			radices[count++] = RADICES[i];
+			n /= RADICES[i];
+		}
+	}
+	return (1 == n) ? count : 0;
+}
+
+static int fft_plan_create(struct fft_plan *plan, int n) {
+	memset(plan, 0, sizeof(*plan));
+	plan->n = n;
+	plan->m = n;
+	plan->num_radices = factor_radices(n, plan->radices);
+	if (0 == plan->num_radices && n > 1) {
+		plan->m = 1;
+		while (plan->m < 2 * n - 1) {
+			plan->m <<= 1;
+		}
+		plan->num_radices = factor_radices(plan->m, plan->radices);
+	}
+	plan->roots = malloc(plan->m * sizeof(cplx));
+	if (NULL == plan->roots) {
+		return -1;
+	}
+	for (int j = 0; j < plan->m; j++) {
+		plan->roots[j] = root_of_unity(j, plan->m);
+	}
+	if (plan->m == n) {
+		return 0;
+	}
+
+	plan->chirp = malloc(n * sizeof(cplx));
+	plan->chirp_fft = calloc(plan->m, sizeof(cplx));
+	cplx *work = malloc(plan->m * sizeof(cplx));
+	if (NULL == plan->chirp || NULL == plan->chirp_fft || NULL == work) {
+		free(work);
+		return -1;
+	}
+	for (int j = 0; j < n; j++) {
+		plan->chirp[j] = root_of_unity((long long)j * j, 2LL * n);
+	}
+	plan->chirp_fft[0] = conj(plan->chirp[0]) / plan->m;
+	for (int j = 1; j < n; j++) {
+		plan->chirp_fft[j] = plan->chirp_fft[plan->m - j] = conj(plan->chirp[j]) / plan->m;
+	}
+	fft_stockham(plan->chirp_fft, work, plan->m, plan->radices, plan->num_radices, plan->roots);
+	free(work);
+	return 0;
+}
+
+static void fft_plan_free(struct fft_plan *plan) {
+	free(plan->roots);
+	free(plan->chirp);
+	free(plan->chirp_fft);
+}
+
+// Forward transform of x in place. work holds 2 * plan->m values.
+static void fft_execute(const struct fft_plan *plan, cplx *x, cplx *work) {
+	const int n = plan->n, m = plan->m;
+	if (m == n) {
+		fft_stockham(x, work, n, plan->radices, plan->num_radices, plan->roots);
+		return;
+	}
+	// X[k] = chirp[k] sum_j (x[j] chirp[j]) conj(chirp[k - j]). The inverse
+	// transform of the convolution is a forward transform of the reversed
+	// sequence, whose scaling is in chirp_fft.
+	cplx *convolution = work + m;
+	for (int j = 0; j < n; j++) {
+		convolution[j] = cmul(x[j], plan->chirp[j]);
+	}
+	memset(convolution + n, 0, (m - n) * sizeof(cplx));
+	fft_stockham(convolution, work, m, plan->radices, plan->num_radices, plan->roots);
+	for (int j = 0; j < m; j++) {
+		convolution[j] = cmul(convolution[j], plan->chirp_fft[j]);
+	}
+	fft_stockham(convolution, work, m, plan->radices, plan->num_radices, plan->roots);
+	x[0] = cmul(convolution[0], plan->chirp[0]);
+	for (int k = 1; k < n; k++) {
+		x[k] = cmul(convolution[m - k], plan->chirp[k]);
+	}
+}
+
+// Transforms count contiguous vectors of the plan's length. The inverse
+// transform is the conjugate of the forward transform of the conjugate,
+// without the 1/n scaling.
+static void fft_batch(const struct fft_plan *plan, cplx *x, int count, int inverse, int num_threads) {
+#pragma omp parallel num_threads(num_threads)
+	{
+		cplx *work = malloc(2 * plan->m * sizeof(cplx));
+#pragma omp for schedule(static)
+		for (int v = 0; v < count; v++) {
+			cplx *vector = x + (size_t)v * plan->n;
+			if (inverse) {
+				for (int j = 0; j < plan->n; j++) {
+					vector[j] = conj(vector[j]);
+				}
+			}
+			fft_execute(plan, vector, work);
+			if (inverse) {
+				for (int j = 0; j < plan->n; j++) {
+					vector[j] = conj(vector[j]);
+				}
+			}
+		}
+		free(work);
+	}
+}
+
+// The matrix is split by rows, rows[r] <= j1 < rows[r + 1] on rank r,
+// stored row by row, or by columns, stored column by column. transpose
+// moves between the two; to_columns gives the direction.
+struct layout {
+	int procs;
+	int id;
+	int n1, n2;
+	int *rows, *columns;
+	int *send_counts, *send_displs, *recv_counts, *recv_displs;
+	cplx *buffer;
+	MPI_Comm comm;
+};
+
+static void transpose(struct layout *l, const cplx *in, cplx *out, int to_columns) {
+	const int my_rows = l->rows[l->id + 1] - l->rows[l->id];
+	const int my_columns = l->columns[l->id + 1] - l->columns[l->id];
+	cplx *send = l->buffer, *recv;
+	int sent = 0, received = 0;
+	for (int q = 0; q < l->procs; q++) {
+		int rows = l->rows[q + 1] - l->rows[q], columns = l->columns[q + 1] - l->columns[q];
+		l->send_counts[q] = to_columns ? my_rows * columns : my_columns * rows;
+		l->recv_counts[q] = to_columns ? rows * my_columns : columns * my_rows;
+		l->send_displs[q] = sent;
+		l->recv_displs[q] = received;
+		sent += l->send_counts[q];
+		received += l->recv_counts[q];
+	}
+	recv = l->buffer + sent;
+
+	for (int q = 0; q < l->procs; q++) {
+		cplx *block = send + l->send_displs[q];
+		if (to_columns) {
+			int first = l->columns[q], columns = l->columns[q + 1] - first;
+			for (int j1 = 0; j1 < my_rows; j1++) {
+				memcpy(block + (size_t)j1 * columns, in + (size_t)j1 * l->n2 + first, columns * sizeof(cplx));
+			}
+		} else {
+			int first = l->rows[q], rows = l->rows[q + 1] - first;
+			for (int c = 0; c < my_columns; c++) {
+				memcpy(block + (size_t)c * rows, in + (size_t)c * l->n1 + first, rows * sizeof(cplx));
+			}
+		}
+	}
+	MPI_Alltoallv(send, l->send_counts, l->send_displs, MPI_C_DOUBLE_COMPLEX, recv, l->recv_counts, l->recv_displs, MPI_C_DOUBLE_COMPLEX, l->comm);
+	// The blocks are transposed in tiles, so that both the reads and the
+	// writes of a tile stay in cache
+	const int TILE = 32;
+	for (int p = 0; p < l->procs; p++) {
+		const cplx *block = recv + l->recv_displs[p];
+		int outer = to_columns ? l->rows[p + 1] - l->rows[p] : l->columns[p + 1] - l->columns[p];
+		int inner = to_columns ? my_columns : my_rows;
+		int first = to_columns ? l->rows[p] : l->columns[p];
+		int length = to_columns ? l->n1 : l->n2;
+		for (int i0 = 0; i0 < outer; i0 += TILE) {
+			for (int j0 = 0; j0 < inner; j0 += TILE) {
+				int i1 = (i0 + TILE < outer) ? i0 + TILE : outer;
+				int j1 = (j0 + TILE < inner) ? j0 + TILE : inner;
+				for (int j = j0; j < j1; j++) {
+					for (int i = i0; i < i1; i++) {
+						out[(size_t)j * length + first + i] = block[(size_t)i * inner + j];
+					}
+				}
+			}
+		}
+	}
+}
+
+// Moves a vector between two partitions into contiguous ranges, given by
+// their displacements, exchanging only the overlapping parts
+static void redistribute(const double *in, const int *from, double *out, const int *to, int procs, int id, MPI_Comm comm) {
+	int *counts = malloc(4 * procs * sizeof(int));
+	int *send_counts = counts, *send_displs = counts + procs, *recv_counts = counts + 2 * procs, *recv_displs = counts + 3 * procs;
+	for (int q = 0; q < procs; q++) {
+		int first = (from[id] > to[q]) ? from[id] : to[q];
+		int last = (from[id + 1] < to[q + 1]) ? from[id + 1] : to[q + 1];
+		send_counts[q] = (last > first) ? last - first : 0;
+		send_displs[q] = (last > first) ? first - from[id] : 0;
+		first = (from[q] > to[id]) ? from[q] : to[id];
+		last = (from[q + 1] < to[id + 1]) ? from[q + 1] : to[id + 1];
+		recv_counts[q] = (last > first) ? last - first : 0;
+		recv_displs[q] = (last > first) ? first - to[id] : 0;
+	}
+	MPI_Alltoallv(in, send_counts, send_displs, MPI_DOUBLE, out, recv_counts, recv_displs, MPI_DOUBLE, comm);
+	free(counts);
+}
+
+int spectral_break_even(int num_values, int width) {
+	// A step of the loop costs about width multiply-adds per point, which
+	// run vectorized. The transforms, the transposes and the eigenvalues
+	// together cost about as much as 64 log2(n) / width steps when n is a
+	// power of two, as measured on 2^20 values; radix 3, 5 and 7 stages are
+	// half again as slow, and Bluestein's algorithm is about four times.
+	int radices[MAX_RADICES];
+	double factor = 4;
+	if (0 == (num_values & (num_values - 1))) {
+		factor = 1;
+	} else if (0 != factor_radices(num_values, radices)) {
+		factor = 1.5;
+	}
+	return (int)ceil(64 * factor * log2(num_values > 1 ? num_values : 2) / width);
+}
+
+int spectral_apply(double *values, const int *displs, const double *stencil, int width, int steps, int num_threads, MPI_Comm comm) {
+	struct layout l;
+	MPI_Comm_size(comm, &l.procs);
+	MPI_Comm_rank(comm, &l.id);
+	l.comm = comm;
+	const int n = displs[l.procs];
+
+	// n1 is the divisor of n closest to its square root from below, so a
+	// prime n is a single row, transformed by one rank
+	l.n1 = 1;
+	for (int d = 1; (long long)d * d <= n; d++) {
+		if (0 == n % d) {
+			l.n1 = d;
+		}
+	}
+	l.n2 = n / l.n1;
+
+	l.rows = malloc(2 * (l.procs + 1) * sizeof(int));
+	l.columns = l.rows + l.procs + 1;
+	int *row_displs = malloc((l.procs + 1) * sizeof(int));
+	for (int r = 0; r <= l.procs; r++) {
+		l.rows[r] = (int)((long long)l.n1 * r / l.procs);
+		l.columns[r] = (int)((long long)l.n2 * r / l.procs);
+		row_displs[r] = l.rows[r] * l.n2;
+	}
+	const int my_rows = l.rows[l.id + 1] - l.rows[l.id];
+	const int my_columns = l.columns[l.id + 1] - l.columns[l.id];
+	const size_t row_count = (size_t)my_rows * l.n2, column_count = (size_t)my_columns * l.n1;
+
+	l.send_counts = malloc(4 * l.procs * sizeof(int));
+	l.send_displs = l.send_counts + l.procs;
+	l.recv_counts = l.send_counts + 2 * l.procs;
+	l.recv_displs = l.send_counts + 3 * l.procs;
+	l.buffer = malloc((row_count + column_count + 1) * sizeof(cplx));
+	cplx *by_rows = malloc((row_count + 1) * sizeof(cplx));
+	cplx *by_columns = malloc((column_count + 1) * sizeof(cplx));
+	double *real = malloc((row_count + 1) * sizeof(double));
+	struct fft_plan column_plan, row_plan;
+	struct twiddle_table twiddles;
+	int status = fft_plan_create(&column_plan, l.n1) | fft_plan_create(&row_plan, l.n2) | twiddle_table_create(&twiddles, n);
+	int failed = (0 != status || NULL == row_displs || NULL == l.send_counts || NULL == l.buffer || NULL == by_rows || NULL == by_columns || NULL == real);
+	MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, comm);
+
+	if (!failed) {
+		// Columns: transform over j1 and twiddle by exp(-2 PI i j2 k1 / n)
+		redistribute(values, displs, real, row_displs, l.procs, l.id, comm);
+		for (size_t i = 0; i < row_count; i++) {
+			by_rows[i] = real[i];
+		}
+		transpose(&l, by_rows, by_columns, 1);
+		fft_batch(&column_plan, by_columns, my_columns, 0, num_threads);
+		for (int c = 0; c < my_columns; c++) {
+			long long j2 = l.columns[l.id] + c;
+			for (int k1 = 0; k1 < l.n1; k1++) {
+				by_columns[(size_t)c * l.n1 + k1] = cmul(by_columns[(size_t)c * l.n1 + k1], twiddle(&twiddles, j2 * k1));
+			}
+		}
+
+		// Rows: transform over j2, which leaves coefficient k1 + n1 k2 at
+		// row k1, column k2. The stencil multiplies coefficient k by
+		// lambda_k = sum_j stencil[j] exp(2 PI i (j - extent) k / n), and the
+		// 1/n of the inverse transform is applied here as well.
+		transpose(&l, by_columns, by_rows, 0);
+		fft_batch(&row_plan, by_rows, my_rows, 0, num_threads);
+		const int extent = width / 2;
+#pragma omp parallel for num_threads(num_threads) schedule(static)
+		for (int r = 0; r < my_rows; r++) {
+			long long k1 = l.rows[l.id] + r;
+			for (int k2 = 0; k2 < l.n2; k2++) {
+				long long k = k1 + (long long)l.n1 * k2;
+				cplx lambda = 0, shift = twiddle(&twiddles, -k), power = twiddle(&twiddles, extent * k);
+				for (int j = 0; j < width; j++) {
+					lambda += stencil[j] * power;
+					power = cmul(power, shift);
+				}
+				cplx factor = 1.0 / n;
+				for (int e = steps; e > 0; e >>= 1) {
+					if (e & 1) {
+						factor = cmul(factor, lambda);
+					}
+					lambda = cmul(lambda, lambda);
+				}
+				by_rows[(size_t)r * l.n2 + k2] = cmul(by_rows[(size_t)r * l.n2 + k2], factor);
+			}
+		}
+
+		// The inverse transform takes the same steps backwards
+		fft_batch(&row_plan, by_rows, my_rows, 1, num_threads);
+		transpose(&l, by_rows, by_columns, 1);
+		for (int c = 0; c < my_columns; c++) {
+			long long j2 = l.columns[l.id] + c;
+			for (int k1 = 0; k1 < l.n1; k1++) {
+				by_columns[(size_t)c * l.n1 + k1] = cmul(by_columns[(size_t)c * l.n1 + k1], twiddle(&twiddles, -j2 * k1));
+			}
+		}
+		fft_batch(&column_plan, by_columns, my_columns, 1, num_threads);
+		transpose(&l, by_columns, by_rows, 0);
+		for (size_t i = 0; i < row_count; i++) {
+			real[i] = creal(by_rows[i]);
+		}
+		redistribute(real, row_displs, values, displs, l.procs, l.id, comm);
+	}
+
+	fft_plan_free(&column_plan);
+	fft_plan_free(&row_plan);
+	twiddle_table_free(&twiddles);
+	free(real);
+	free(by_columns);
+	free(by_rows);
+	free(l.buffer);
+	free(l.send_counts);
+	free(row_displs);
+	free(l.rows);
+	return failed ? -1 : 0;
+}
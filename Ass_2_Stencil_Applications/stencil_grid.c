@@ -0,0 +1,509 @@
+/**
+ * Applies a stencil on a periodic 2D or 3D grid of function values
+ * f(x) = sin(x_0) sin(x_1) ... for 0<=x_k<2*PI. The grid is split over a
+ * Cartesian grid of processes, and every application exchanges halos with
+ * the neighbours in each dimension through persistent requests on subarray
+ * datatypes, so the faces are sent straight out of the grid without packing.
+ * A star stencil applies the 1D stencil along every axis and adds the
+ * results. A box stencil is the tensor product of the 1D stencils, which
+ * also reads the edge and corner neighbours.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "stencil.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX_DIMS 3
+
+// The local part of the grid. Arrays are always indexed in MAX_DIMS
+// dimensions with the last one contiguous; a 2D grid uses the last two and
+// the first has a single point and no halo, so the innermost loops always
+// run along a real dimension.
+struct grid {
+    int dims;
+    int first_dim;               // MAX_DIMS - dims, the first dimension in use
+    int size[MAX_DIMS];          // local points
+    int halo[MAX_DIMS];          // ghost points on each side
+    int extended[MAX_DIMS];      // size + 2 * halo
+    int offset[MAX_DIMS];        // global index of the first local point
+    int global[MAX_DIMS];        // global points
+    size_t stride[MAX_DIMS];
+    size_t count;                // points including the ghosts
+    double *values[2];
+    MPI_Request request[2][4 * MAX_DIMS];
+    MPI_Datatype face[MAX_DIMS][4];
+};
+
+// The stencil as a list of terms: output[i] = sum of weight[t] * input[i + offset[t]]
+struct terms {
+    int count;
+    long *offset;
+    double *weight;
+};
+
+// Creates the four face datatypes of dimension d: the lowest and highest
+// halo planes of local points, which are sent to the lower and upper
+// neighbour, and the ghost planes below and above, which receive from them.
+// Box stencils exchange one dimension after another, and the faces of later
+// dimensions include the ghosts of earlier ones, so the edges and corners
+// arrive in two or three hops.
+void create_faces(struct grid *g, int d, int box) {
+    int sizes[MAX_DIMS], subsizes[MAX_DIMS], starts[MAX_DIMS];
+    for (int f = 0; f < 4; f++) {
+        for (int k = 0; k < g->dims; k++) {
+            int dim = g->first_dim + k;
+            sizes[k] = g->extended[dim];
+            if (dim == d) {
+                const int face_starts[4] = {g->halo[d], g->size[d], 0, g->halo[d] + g->size[d]};
+                subsizes[k] = g->halo[d];
+                starts[k] = face_starts[f];
+            } else if (box && dim < d) {
+                subsizes[k] = g->extended[dim];
+                starts[k] = 0;
+            } else {
+                subsizes[k] = g->size[dim];
+                starts[k] = g->halo[dim];
+            }
+        }
+        MPI_Type_create_subarray(g->dims, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &g->face[d][f]);
+        MPI_Type_commit(&g->face[d][f]);
+    }
+}
+
+// Sets up the persistent halo requests of both buffers. The four requests of
+// dimension d are request[4 * k ...] for its index k among the used ones.
+// Tag 2k carries data upwards and tag 2k + 1 downwards.
+void setup_halo_requests(struct grid *g, MPI_Comm cart) {
+    for (int k = 0; k < g->dims; k++) {
+        int d = g->first_dim + k, lower, upper;
+        MPI_Cart_shift(cart, k, 1, &lower, &upper);
+        for (int b = 0; b < 2; b++) {
+            MPI_Request *request = &g->request[b][4 * k];
+            MPI_Send_init(g->values[b], 1, g->face[d][0], lower, 2 * k + 1, cart, &request[0]);
+            MPI_Send_init(g->values[b], 1, g->face[d][1], upper, 2 * k, cart, &request[1]);
+            MPI_Recv_init(g->values[b], 1, g->face[d][2], lower, 2 * k, cart, &request[2]);
+            MPI_Recv_init(g->values[b], 1, g->face[d][3], upper, 2 * k + 1, cart, &request[3]);
+        }
+    }
+}
+
+// Builds the terms of a star or box stencil from the 1D coefficients of each
+// dimension. Terms with a zero weight are left out, which removes most of
+// a box stencil of odd derivatives.
+void build_terms(const struct grid *g, double **coefficients, int width, int box, struct terms *terms) {
+    const int EXTENT = width / 2;
+    int max_terms = 1 + g->dims * (width - 1);
+    if (box) {
+        max_terms = 1;
+        for (int k = 0; k < g->dims; k++) {
+            max_terms *= width;
+        }
+    }
+    terms->offset = malloc(max_terms * sizeof(long));
+    terms->weight = malloc(max_terms * sizeof(double));
+    terms->count = 0;
+
+    if (!box) {
+        double centre = 0;
+        for (int k = 0; k < g->dims; k++) {
+            centre += coefficients[k][EXTENT];
+        }
+        terms->offset[0] = 0;
+        terms->weight[0] = centre;
+        terms->count = (0 != centre);
+        for (int k = 0; k < g->dims; k++) {
+            for (int j = 0; j < width; j++) {
+                if (j != EXTENT && 0 != coefficients[k][j]) {
+                    terms->offset[terms->count] = (long)(j - EXTENT) * (long)g->stride[g->first_dim + k];
+                    terms->weight[terms->count++] = coefficients[k][j];
+                }
+            }
+        }
+        return;
+    }
+
+    for (int t = 0; t < max_terms; t++) {
+        long offset = 0;
+        double weight = 1;
+        for (int k = 0, rest = t; k < g->dims; k++, rest /= width) {
+            int j = rest % width;
+            offset += (long)(j - EXTENT) * (long)g->stride[g->first_dim + k];
+            weight *= coefficients[k][j];
+        }
+        if (0 != weight) {
+            terms->offset[terms->count] = offset;
+            terms->weight[terms->count++] = weight;
+        }
+    }
+    if (0 == terms->count) {
+        terms->offset[0] = 0;
+        terms->weight[0] = 0;
+        terms->count = 1;
+    }
+}
+
+// Applies the stencil to the points in [lo, hi) of every dimension. The
+// rows along the last dimension are split between the threads, and each
+// row accumulates one term at a time, so the inner loop is a contiguous
+// multiply-add that vectorizes.
+void apply_region(const struct grid *g, const struct terms *terms, const double *input, double *output, const int *lo, const int *hi) {
+    if (lo[0] >= hi[0] || lo[1] >= hi[1] || lo[2] >= hi[2]) {
+        return;
+    }
+    const size_t S0 = g->stride[0], S1 = g->stride[1];
+#pragma omp parallel for collapse(2) schedule(static)
+    for (int i0 = lo[0]; i0 < hi[0]; i0++) {
+        for (int i1 = lo[1]; i1 < hi[1]; i1++) {
+            double *restrict out = output + i0 * S0 + i1 * S1;
+            const double *in = input + i0 * S0 + i1 * S1;
+            for (int i2 = lo[2]; i2 < hi[2]; i2++) {
+                out[i2] = terms->weight[0] * in[i2 + terms->offset[0]];
+            }
+            for (int t = 1; t < terms->count; t++) {
+                const double w = terms->weight[t];
+                const double *shifted = in + terms->offset[t];
+                for (int i2 = lo[2]; i2 < hi[2]; i2++) {
+                    out[i2] += w * shifted[i2];
+                }
+            }
+        }
+    }
+}
+
+// One application of a star stencil: all faces are in flight while the
+// interior, which reads no ghosts, is computed, and then the shell of
+// halo-thick slabs next to the faces is computed. Slab k spans the interior
+// range in the dimensions before k and the whole local range after it, so
+// the slabs do not overlap.
+void star_step(struct grid *g, const struct terms *terms, int current, double *wait_time) {
+    const double *input = g->values[current];
+    double *output = g->values[1 - current];
+    int inner_lo[MAX_DIMS], inner_hi[MAX_DIMS];
+    for (int d = 0; d < MAX_DIMS; d++) {
+        inner_lo[d] = 2 * g->halo[d];
+        inner_hi[d] = g->size[d];
+        if (inner_hi[d] < inner_lo[d]) {
+            inner_hi[d] = inner_lo[d];
+        }
+    }
+
+    MPI_Startall(4 * g->dims, g->request[current]);
+    apply_region(g, terms, input, output, inner_lo, inner_hi);
+    double start = MPI_Wtime();
+    MPI_Waitall(4 * g->dims, g->request[current], MPI_STATUSES_IGNORE);
+    *wait_time += MPI_Wtime() - start;
+
+    for (int d = g->first_dim; d < MAX_DIMS; d++) {
+        int lo[MAX_DIMS], hi[MAX_DIMS];
+        for (int k = 0; k < MAX_DIMS; k++) {
+            lo[k] = (k < d) ? inner_lo[k] : g->halo[k];
+            hi[k] = (k < d) ? inner_hi[k] : g->halo[k] + g->size[k];
+        }
+        hi[d] = inner_lo[d];
+        apply_region(g, terms, input, output, lo, hi);
+        lo[d] = inner_hi[d];
+        hi[d] = g->halo[d] + g->size[d];
+        apply_region(g, terms, input, output, lo, hi);
+    }
+}
+
+// One application of a box stencil, after exchanging the dimensions one at
+// a time so that edges and corners are filled
+void box_step(struct grid *g, const struct terms *terms, int current, double *wait_time) {
+    double start = MPI_Wtime();
+    for (int k = 0; k < g->dims; k++) {
+        MPI_Startall(4, &g->request[current][4 * k]);
+        MPI_Waitall(4, &g->request[current][4 * k], MPI_STATUSES_IGNORE);
+    }
+    *wait_time += MPI_Wtime() - start;
+
+    int lo[MAX_DIMS], hi[MAX_DIMS];
+    for (int d = 0; d < MAX_DIMS; d++) {
+        lo[d] = g->halo[d];
+        hi[d] = g->halo[d] + g->size[d];
+    }
+    apply_region(g, terms, g->values[current], g->values[1 - current], lo, hi);
+}
+
+// Writes the local points of the grid to their place in a file of raw
+// doubles in row-major order, through a subarray view of the file and a
+// subarray of the extended buffer in memory
+int write_grid(const char *file_name, const struct grid *g, const double *values, MPI_Comm cart) {
+    int sizes[MAX_DIMS], subsizes[MAX_DIMS], starts[MAX_DIMS], memory_sizes[MAX_DIMS], memory_starts[MAX_DIMS];
+    for (int k = 0; k < g->dims; k++) {
+        int d = g->first_dim + k;
+        sizes[k] = g->global[d];
+        subsizes[k] = g->size[d];
+        starts[k] = g->offset[d];
+        memory_sizes[k] = g->extended[d];
+        memory_starts[k] = g->halo[d];
+    }
+    MPI_Datatype file_type, memory_type;
+    MPI_Type_create_subarray(g->dims, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &file_type);
+    MPI_Type_create_subarray(g->dims, memory_sizes, subsizes, memory_starts, MPI_ORDER_C, MPI_DOUBLE, &memory_type);
+    MPI_Type_commit(&file_type);
+    MPI_Type_commit(&memory_type);
+
+    MPI_File file;
+    int status = MPI_File_open(cart, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+    if (MPI_SUCCESS == status) {
+        MPI_File_set_size(file, 0);
+        MPI_File_set_view(file, 0, MPI_DOUBLE, file_type, "native", MPI_INFO_NULL);
+        status = MPI_File_write_all(file, values, 1, memory_type, MPI_STATUS_IGNORE);
+        MPI_File_close(&file);
+    }
+    MPI_Type_free(&file_type);
+    MPI_Type_free(&memory_type);
+    return (MPI_SUCCESS == status) ? 0 : -1;
+}
+
+// Appends a line with the run's configuration and time to a CSV file, with
+// a header if the file is new
+int append_csv(const char *file_name, int procs, long long points, int steps, double time, int dims, const int *cart_dims, const char *shape) {
+    FILE *file = fopen(file_name, "a");
+    if (NULL == file) {
+        perror("Couldn't open CSV file");
+        return -1;
+    }
+    if (0 == ftell(file)) {
+        fprintf(file, "procs,points,steps,time,dimensions,grid,stencil\n");
+    }
+    fprintf(file, "%d,%lld,%d,%f,%d,", procs, points, steps, time, dims);
+    for (int k = 0; k < dims; k++) {
+        fprintf(file, (k == 0) ? "%d" : "x%d", cart_dims[k]);
+    }
+    fprintf(file, ",%s\n", shape);
+    return fclose(file);
+}
+
+int main(int argc, char **argv) {
+    const char *USAGE = "Usage: stencil_grid dimensions points number_of_applications [-g p0,p1,...] [-S star|box] [-w width] [-d derivative] [-t threads] [-p] [-o output_file] [-c csv_file]\n";
+    int num_threads = 1;
+    int stencil_width = 3, derivative = 2;
+    int per_process = 0;
+    int cart_dims[MAX_DIMS] = {0, 0, 0};
+    int grid_entries = 0;
+    const char *shape = "star";
+    const char *output_name = NULL;
+    const char *csv_name = NULL;
+    int bad_arguments = argc < 4;
+    for (int i = 4; i < argc && !bad_arguments; i++) {
+        if (0 == strcmp(argv[i], "-g") && i + 1 < argc) {
+            // A comma separated list of at most dimensions non-negative
+            // numbers, whose count is checked once the dimensions are known
+            char *next = argv[++i];
+            for (grid_entries = 0; !bad_arguments && *next; grid_entries++) {
+                char *end;
+                long value = strtol(next, &end, 10);
+                bad_arguments = grid_entries >= MAX_DIMS || end == next || value < 0 || value > INT_MAX || (*end && ',' != *end);
+                cart_dims[grid_entries] = (int)value;
+                next = end + (',' == *end);
+            }
+        } else if (0 == strcmp(argv[i], "-S") && i + 1 < argc) {
+            shape = argv[++i];
+            bad_arguments = strcmp(shape, "star") && strcmp(shape, "box");
+        } else if (0 == strcmp(argv[i], "-w") && i + 1 < argc) {
+            stencil_width = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-d") && i + 1 < argc) {
+            derivative = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-t") && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "-p")) {
+            per_process = 1;
+        } else if (0 == strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (0 == strcmp(argv[i], "-c") && i + 1 < argc) {
+            csv_name = argv[++i];
+        } else {
+            bad_arguments = 1;
+        }
+    }
+    int dims = (argc < 4) ? 0 : atoi(argv[1]);
+    int points = (argc < 4) ? 0 : atoi(argv[2]);
+    int num_steps = (argc < 4) ? 0 : atoi(argv[3]);
+    if (bad_arguments || dims < 2 || dims > MAX_DIMS || grid_entries > dims || points < 1) {
+        fputs(USAGE, stdout);
+        return 1;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#endif
+    const int box = (0 == strcmp(shape, "box"));
+
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+    int procs, id;
+    MPI_Comm_size(MPI_COMM_WORLD, &procs);
+
+    // The process grid is as square as possible, apart from dimensions
+    // fixed with -g, and is periodic in every dimension
+    // MPI_Dims_create fails, fatally with the default error handler, unless
+    // the fixed dimensions divide the processes and, if all are fixed, give
+    // exactly as many
+    long fixed = 1;
+    int free_dims = 0;
+    for (int k = 0; k < dims; k++) {
+        fixed *= (cart_dims[k] > 0) ? cart_dims[k] : 1;
+        free_dims += (0 == cart_dims[k]);
+        fixed = (fixed > procs) ? procs + 1L : fixed;
+    }
+    if (0 != procs % fixed || (0 == free_dims && fixed != procs)) {
+        MPI_Comm_rank(MPI_COMM_WORLD, &id);
+        if (id == 0) {
+            fputs(USAGE, stdout);
+            fprintf(stderr, "The process grid given with -g doesn't match the %d processes\n", procs);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    int periods[MAX_DIMS] = {1, 1, 1};
+    MPI_Comm cart;
+    MPI_Dims_create(procs, dims, cart_dims);
+    MPI_Cart_create(MPI_COMM_WORLD, dims, cart_dims, periods, 1, &cart);
+    MPI_Comm_rank(cart, &id);
+    int coords[MAX_DIMS];
+    MPI_Cart_coords(cart, id, dims, coords);
+
+    // Every dimension has points points, or points per process with -p for
+    // weak scaling, split as evenly as possible between its processes
+    const int EXTENT = stencil_width / 2;
+    struct grid g;
+    memset(&g, 0, sizeof(g));
+    g.dims = dims;
+    g.first_dim = MAX_DIMS - dims;
+    g.count = 1;
+    int too_small = 0;
+    for (int d = MAX_DIMS - 1; d >= 0; d--) {
+        int k = d - g.first_dim;
+        if (k < 0) {
+            g.size[d] = g.global[d] = 1;
+        } else {
+            g.global[d] = per_process ? points * cart_dims[k] : points;
+            int share = g.global[d] / cart_dims[k], rest = g.global[d] % cart_dims[k];
+            g.size[d] = share + (coords[k] < rest);
+            g.offset[d] = coords[k] * share + (coords[k] < rest ? coords[k] : rest);
+            g.halo[d] = EXTENT;
+            too_small |= g.size[d] < EXTENT;
+        }
+        g.extended[d] = g.size[d] + 2 * g.halo[d];
+        g.stride[d] = g.count;
+        g.count *= g.extended[d];
+    }
+
+    double *coefficients[MAX_DIMS];
+    int bad_stencil = 0;
+    for (int k = 0; k < dims; k++) {
+        coefficients[k] = malloc((stencil_width > 0 ? stencil_width : 1) * sizeof(double));
+        bad_stencil |= 0 != stencil_coefficients(derivative, stencil_width, 2.0 * PI / g.global[g.first_dim + k], coefficients[k]);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &too_small, 1, MPI_INT, MPI_LOR, cart);
+    if (bad_stencil || too_small) {
+        if (id == 0) {
+            fprintf(stderr, bad_stencil ? "Invalid stencil: the width must be odd and at least 3, and larger than the derivative order\n"
+                                        : "Too many processes: every process needs at least %d points per dimension\n", EXTENT);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    for (int b = 0; b < 2; b++) {
+        if (0 != posix_memalign((void **)&g.values[b], STENCIL_ALIGNMENT, g.count * sizeof(double))) {
+            perror("Couldn't allocate memory for the grid");
+            MPI_Abort(cart, 2);
+        }
+        memset(g.values[b], 0, g.count * sizeof(double));
+    }
+    for (int d = g.first_dim; d < MAX_DIMS; d++) {
+        create_faces(&g, d, box);
+    }
+    setup_halo_requests(&g, cart);
+    struct terms terms;
+    build_terms(&g, coefficients, stencil_width, box, &terms);
+
+    // Initial values f(x) = sin(x_0) sin(x_1) ... at the local points
+    for (int i0 = g.halo[0]; i0 < g.halo[0] + g.size[0]; i0++) {
+        for (int i1 = g.halo[1]; i1 < g.halo[1] + g.size[1]; i1++) {
+            for (int i2 = g.halo[2]; i2 < g.halo[2] + g.size[2]; i2++) {
+                const int index[MAX_DIMS] = {i0, i1, i2};
+                double value = 1;
+                for (int d = g.first_dim; d < MAX_DIMS; d++) {
+                    value *= sin(2.0 * PI * (g.offset[d] + index[d] - g.halo[d]) / g.global[d]);
+                }
+                g.values[0][i0 * g.stride[0] + i1 * g.stride[1] + i2] = value;
+            }
+        }
+    }
+
+    double wait_time = 0;
+
+    // Start timer
+    double local_start_time, local_elapsed_time, max_elapsed_time;
+    MPI_Barrier(cart);
+    local_start_time = MPI_Wtime();
+
+    int current = 0;
+    for (int s = 0; s < num_steps; s++) {
+        if (box) {
+            box_step(&g, &terms, current, &wait_time);
+        } else {
+            star_step(&g, &terms, current, &wait_time);
+        }
+        current = 1 - current;
+    }
+
+    // Stop timer
+    local_elapsed_time = MPI_Wtime() - local_start_time;
+    MPI_Reduce(&local_elapsed_time, &max_elapsed_time, 1, MPI_DOUBLE, MPI_MAX, 0, cart);
+    double max_wait_time;
+    MPI_Reduce(&wait_time, &max_wait_time, 1, MPI_DOUBLE, MPI_MAX, 0, cart);
+
+    long long total_points = 1;
+    for (int d = 0; d < MAX_DIMS; d++) {
+        total_points *= g.global[d];
+    }
+    if (id == 0) {
+        printf("%f\n", max_elapsed_time);
+        fprintf(stderr, "grid: %d", cart_dims[0]);
+        for (int k = 1; k < dims; k++) {
+            fprintf(stderr, "x%d", cart_dims[k]);
+        }
+        fprintf(stderr, " processes, %s stencil with %d terms, threads: %d, max halo wait: %f\n", shape, terms.count, num_threads, max_wait_time);
+        if (NULL != csv_name) {
+            append_csv(csv_name, procs, total_points, num_steps, max_elapsed_time, dims, cart_dims, shape);
+        }
+    }
+
+    if (NULL != output_name && 0 != write_grid(output_name, &g, g.values[current], cart) && id == 0) {
+        fprintf(stderr, "Failed to write output\n");
+    }
+
+    for (int b = 0; b < 2; b++) {
+        for (int r = 0; r < 4 * dims; r++) {
+            MPI_Request_free(&g.request[b][r]);
+        }
+        free(g.values[b]);
+    }
+    for (int d = g.first_dim; d < MAX_DIMS; d++) {
+        for (int f = 0; f < 4; f++) {
+            MPI_Type_free(&g.face[d][f]);
+        }
+    }
+    for (int k = 0; k < dims; k++) {
+        free(coefficients[k]);
+    }
+    free(terms.offset);
+    free(terms.weight);
+    MPI_Comm_free(&cart);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,639 @@
+/**
+ * File input and output for the stencil programs: the text format described
+ * in stencil.h, which is parsed from a memory mapped file by several threads,
+ * and the binary format, which is read with MPI-IO so that each process only
+ * reads its own part of the values.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "stencil.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Whitespace as accepted by fscanf between values
+static int is_space(char c) {
+        return ' ' == c || '\n' == c || '\t' == c || '\r' == c || '\v' == c || '\f' == c;
+}
+
+// Parses the value in [begin, end), which must be the whole token. Decimal
+// values with at most 19 significant digits whose mantissa and power of ten
+// are exactly representable as doubles are converted with one correctly
+// rounded multiplication or division; everything else goes through strtod.
+// Returns 0 on success, -1 if the token is not a number.
+static int parse_value(const char *begin, const char *end, double *value) {
+        static const double POWERS[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        const char *c = begin;
+        int negative = 0;
+        if (c < end && ('-' == *c || '+' == *c)) {
+                negative = ('-' == *c++);
+        }
+        unsigned long long mantissa = 0;
+        int digits = 0, exponent = 0, fast = 1;
+        const char *digits_start = c;
+        for (; c < end && *c >= '0' && *c <= '9'; c++) {
+                if (digits < 19) {
+                        mantissa = mantissa * 10 + (*c - '0');
+                        digits += (mantissa > 0);
+                } else {
+                        fast = 0;
+                }
+        }
+        int any_digits = (c > digits_start);
+        if (c < end && '.' == *c) {
+                c++;
+                const char *fraction_start = c;
+                for (; c < end && *c >= '0' && *c <= '9'; c++) {
+                        if (digits < 19) {
+                                mantissa = mantissa * 10 + (*c - '0');
+                                digits += (mantissa > 0);
+                                exponent--;
+                        } else {
+                                fast = 0;
+                        }
+                }
+                any_digits |= (c > fraction_start);
+        }
+        if (any_digits && c < end && ('e' == *c || 'E' == *c)) {
+                const char *exponent_start = ++c;
+                int exponent_sign = 1, written = 0;
+                if (c < end && ('-' == *c || '+' == *c)) {
+                        exponent_sign = ('-' == *c++) ? -1 : 1;
+                }
+                for (; c < end && *c >= '0' && *c <= '9'; c++) {
+                        written = (written < 10000) ? written * 10 + (*c - '0') : written;
+                }
+                fast &= (c > exponent_start && ('0' <= c[-1] && c[-1] <= '9'));
+                exponent += exponent_sign * written;
+        }
+        if (fast && any_digits && c == end && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+                double result = (double)mantissa;
+                result = (exponent < 0) ? result / POWERS[-exponent] : result * POWERS[exponent];
+                *value = negative ? -result : result;
+                return 0;
+        }
+
+        char token[128];
+        if (end - begin >= (long)sizeof(token)) {
+                return -1;
+        }
+        memcpy(token, begin, end - begin);
+        token[end - begin] = '\0';
+        char *parsed;
+        *value = strtod(token, &parsed);
+        return (parsed == token + (end - begin)) ? 0 : -1;
+}
+
+// Counts the whitespace separated tokens in [begin, end)
+static long count_tokens(const char *begin, const char *end) {
+        long count = 0;
+        int in_token = 0;
+        for (const char *c = begin; c < end; c++) {
+                int space = is_space(*c);
+                count += (!space && !in_token);
+                in_token = !space;
+        }
+        return count;
+}
+
+int read_input(const char *file_name, double **values) {
+        int fd;
+        if (0 > (fd = open(file_name, O_RDONLY))) {
+                perror("Couldn't open input file");
+                return -1;
+        }
+        struct stat file_stat;
+        if (0 != fstat(fd, &file_stat)) {
+                perror("Couldn't open input file");
+                close(fd);
+                return -1;
+        }
+        size_t size = file_stat.st_size;
+        const char *text = (0 == size) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (MAP_FAILED == text) {
+                fprintf(stderr, "Couldn't read element count from input file\n");
+                return -1;
+        }
+        posix_madvise((void *)text, size, POSIX_MADV_SEQUENTIAL);
+        const char *end = text + size;
+
+        // The element count is the first token
+        const char *c = text;
+        while (c < end && is_space(*c)) {
+                c++;
+        }
+        const char *count_end = c;
+        while (count_end < end && !is_space(*count_end)) {
+                count_end++;
+        }
+        double count;
+        if (c == end || 0 != parse_value(c, count_end, &count) || count < 0 || count > INT_MAX || count != floor(count)) {
+                fprintf(stderr, "Couldn't read element count from input file\n");
+                munmap((void *)text, size);
+                return -1;
+        }
+        int num_values = (int)count;
+        if (NULL == (*values = malloc(num_values * sizeof(double)))) {
+                perror("Couldn't allocate memory for input");
+                munmap((void *)text, size);
+                return -1;
+        }
+
+        // Split the rest of the file into one chunk per thread, moving every
+        // chunk boundary forward to whitespace so that no value is split.
+        // Each thread counts the values in its chunk, and after a prefix sum
+        // over the counts parses them into place.
+        int chunks = 1;
+#ifdef _OPENMP
+        chunks = omp_get_max_threads();
+#endif
+        const char **bounds = malloc((chunks + 1) * sizeof(*bounds));
+        long *first_value = malloc((chunks + 1) * sizeof(*first_value));
+        bounds[0] = count_end;
+        for (int t = 1; t < chunks; t++) {
+                const char *bound = count_end + (end - count_end) / chunks * t;
+                if (bound < bounds[t - 1]) {
+                        bound = bounds[t - 1];
+                }
+                while (bound < end && !is_space(*bound)) {
+                        bound++;
+                }
+                bounds[t] = bound;
+        }
+        bounds[chunks] = end;
+
+#pragma omp parallel for schedule(static, 1)
+        for (int t = 0; t < chunks; t++) {
+                first_value[t + 1] = count_tokens(bounds[t], bounds[t + 1]);
+        }
+        first_value[0] = 0;
+        for (int t = 0; t < chunks; t++) {
+                first_value[t + 1] += first_value[t];
+        }
+
+        int malformed = 0;
+#pragma omp parallel for schedule(static, 1) reduction(|:malformed)
+        for (int t = 0; t < chunks; t++) {
+                long index = first_value[t];
+                const char *token = bounds[t];
+                while (index < num_values) {
+                        while (token < bounds[t + 1] && is_space(*token)) {
+                                token++;
+                        }
+                        if (token == bounds[t + 1]) {
+                                break;
+                        }
+                        const char *token_end = token;
+                        while (token_end < bounds[t + 1] && !is_space(*token_end)) {
+                                token_end++;
+                        }
+                        malformed |= (0 != parse_value(token, token_end, &(*values)[index++]));
+                        token = token_end;
+                }
+        }
+        long total = first_value[chunks];
+        free(bounds);
+        free(first_value);
+        if (0 != munmap((void *)text, size)){
+                perror("Warning: couldn't close input file");
+        }
+        if (malformed || total < num_values) {
+                fprintf(stderr, "Couldn't read elements from input file\n");
+                free(*values);
+                *values = NULL;
+                return -1;
+        }
+        return num_values;
+}
+
+
+int write_output(char *file_name, const double *output, int num_values) {
+        FILE *file;
+        if (NULL == (file = fopen(file_name, "w"))) {
+                perror("Couldn't open output file");
+                return -1;
+        }
+        for (int i = 0; i < num_values; i++) {
+                if (0 > fprintf(file, "%.4f ", output[i])) {
+                        perror("Couldn't write to output file");
+                }
+        }
+        if (0 > fprintf(file, "\n")) {
+                perror("Couldn't write to output file");
+        }
+        if (0 != fclose(file)) {
+                perror("Warning: couldn't close output file");
+        }
+        return 0;
+}
+
+
+int open_binary_input(const char *file_name, MPI_Comm comm, MPI_File *file) {
+        int id;
+        MPI_Comm_rank(comm, &id);
+        if (MPI_SUCCESS != MPI_File_open(comm, file_name, MPI_MODE_RDONLY, MPI_INFO_NULL, file)) {
+                if (id == 0) {
+                        fprintf(stderr, "Couldn't open input file %s\n", file_name);
+                }
+                return -1;
+        }
+        stencil_file_header header;
+        MPI_Status status;
+        int count = 0;
+        if (MPI_SUCCESS == MPI_File_read_at_all(*file, 0, &header, sizeof(header), MPI_BYTE, &status)) {
+                MPI_Get_count(&status, MPI_BYTE, &count);
+        }
+        if (sizeof(header) != count || 0 != memcmp(header.magic, STENCIL_MAGIC, sizeof(header.magic))) {
+                MPI_File_close(file);
+                return 0;
+        }
+        if (sizeof(double) != header.value_size || header.count <= 0 || header.count > INT_MAX) {
+                if (id == 0) {
+                        fprintf(stderr, "Unsupported binary input file %s\n", file_name);
+                }
+                MPI_File_close(file);
+                return -1;
+        }
+        return (int)header.count;
+}
+
+
+int read_binary_input(MPI_File *file, int first, int count, double *values) {
+        MPI_Offset offset = sizeof(stencil_file_header) + (MPI_Offset)first * sizeof(double);
+        MPI_Status status;
+        int read = 0;
+        if (MPI_SUCCESS == MPI_File_read_at_all(*file, offset, values, count, MPI_DOUBLE, &status)) {
+                MPI_Get_count(&status, MPI_DOUBLE, &read);
+        }
+        MPI_File_close(file);
+        if (read != count) {
+                fprintf(stderr, "Couldn't read elements from input file\n");
+                return -1;
+        }
+        return 0;
+}
+
+
+// Formats a value like fprintf(file, "%.4f ", value) and returns the number
+// of characters written. Values are scaled by 10^4 and rounded in integer
+// arithmetic; where that could round differently from printf (very large
+// values, values within the rounding error of a tie, NaN and infinity),
+// snprintf does the work.
+static int format_value(double value, char *buffer) {
+        double scaled = fabs(value) * 10000.0;
+        double whole = floor(scaled);
+        if (!(scaled < 1e11) || fabs(scaled - whole - 0.5) < 1e-4) {
+                return snprintf(buffer, FORMATTED_VALUE_MAX, "%.4f ", value);
+        }
+        unsigned long long digits = (unsigned long long)whole + (scaled - whole > 0.5);
+        char reversed[24];
+        int length = 0;
+        for (int i = 0; i < 4; i++) {
+                reversed[length++] = '0' + digits % 10;
+                digits /= 10;
+        }
+        reversed[length++] = '.';
+        do {
+                reversed[length++] = '0' + digits % 10;
+                digits /= 10;
+        } while (digits > 0);
+        int written = 0;
+        if (signbit(value)) {
+                buffer[written++] = '-';
+        }
+        while (length > 0) {
+                buffer[written++] = reversed[--length];
+        }
+        buffer[written++] = ' ';
+        return written;
+}
+
+
+int write_output_parallel(const char *file_name, const double *values, int count, MPI_Comm comm) {
+        int id, procs;
+        MPI_Comm_rank(comm, &id);
+        MPI_Comm_size(comm, &procs);
+
+        // Format the local values, growing the buffer when a value could
+        // exceed the space left
+        size_t capacity = (size_t)count * 16 + FORMATTED_VALUE_MAX + 1;
+        size_t length = 0;
+        char *text = malloc(capacity);
+        for (int i = 0; i < count && NULL != text; i++) {
+                if (capacity - length < FORMATTED_VALUE_MAX) {
+                        capacity *= 2;
+                        char *grown = realloc(text, capacity);
+                        if (NULL == grown) {
+                                free(text);
+                                text = NULL;
+                                break;
+                        }
+                        text = grown;
+                }
+                length += format_value(values[i], text + length);
+        }
+        if (NULL != text && id == procs - 1) {
+                text[length++] = '\n';
+        }
+        int ok = (NULL != text && length <= INT_MAX);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+        if (!ok) {
+                if (id == 0) {
+                        fprintf(stderr, "Couldn't allocate memory for output\n");
+                }
+                free(text);
+                return -1;
+        }
+
+        long long local_length = length, offset = 0;
+        MPI_Exscan(&local_length, &offset, 1, MPI_LONG_LONG, MPI_SUM, comm);
+        if (id == 0) {
+                offset = 0;
+        }
+
+        MPI_File file;
+        if (MPI_SUCCESS != MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file)) {
+                if (id == 0) {
+                        fprintf(stderr, "Couldn't open output file %s\n", file_name);
+                }
+                free(text);
+                return -1;
+        }
+        int result = 0;
+        if (MPI_SUCCESS != MPI_File_set_size(file, 0) ||
+            MPI_SUCCESS != MPI_File_write_at_all(file, offset, text, (int)length, MPI_CHAR, MPI_STATUS_IGNORE)) {
+                if (id == 0) {
+                        fprintf(stderr, "Couldn't write to output file %s\n", file_name);
+                }
+                result = -1;
+        }
+        MPI_File_close(&file);
+        free(text);
+        return result;
+}
+
+
+int write_binary_output(const char *file_name, const double *values, int first, int count, int num_values, int steps, MPI_Comm comm) {
+        int id;
+        MPI_Comm_rank(comm, &id);
+
+        MPI_File file;
+        if (MPI_SUCCESS != MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file)) {
+                if (id == 0) {
+                        fprintf(stderr, "Couldn't open output file %s\n", file_name);
+                }
+                return -1;
+        }
+        stencil_file_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STENCIL_MAGIC, sizeof(STENCIL_MAGIC));
+        header.count = num_values;
+        header.value_size = sizeof(double);
+        header.version = 1;
+        header.steps = steps;
+
+        // Every rank takes part in the collective calls whatever happened
+        // before, and the ranks agree on the outcome afterwards
+        MPI_Offset offset = sizeof(header) + (MPI_Offset)first * sizeof(double);
+        int ok = (MPI_SUCCESS == MPI_File_set_size(file, 0));
+        if (id == 0 && ok) {
+                ok = (MPI_SUCCESS == MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE));
+        }
+        ok &= (MPI_SUCCESS == MPI_File_write_at_all(file, offset, values, count, MPI_DOUBLE, MPI_STATUS_IGNORE));
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+        if (!ok && id == 0) {
+                fprintf(stderr, "Couldn't write to output file %s\n", file_name);
+        }
+        MPI_File_close(&file);
+        return ok ? 0 : -1;
+}
+
+
+// Name of a snapshot slot of an output file, or NULL if out of memory
+static char *snapshot_name(const char *output_name, int slot) {
+        size_t size = strlen(output_name) + sizeof(".snap0");
+        char *name = malloc(size);
+        if (NULL != name) {
+                snprintf(name, size, "%s.snap%d", output_name, slot);
+        }
+        return name;
+}
+
+
+// Reads the header of a snapshot slot. Returns the number of values if the
+// snapshot is complete, and 0 if it is not or doesn't exist. This is a
+// collective operation.
+static int read_snapshot_header(const char *name, MPI_Comm comm, MPI_File *file, int64_t *steps) {
+        if (NULL == name || MPI_SUCCESS != MPI_File_open(comm, name, MPI_MODE_RDONLY, MPI_INFO_NULL, file)) {
+                return 0;
+        }
+        stencil_file_header header;
+        MPI_Status status;
+        int count = 0;
+        if (MPI_SUCCESS == MPI_File_read_at_all(*file, 0, &header, sizeof(header), MPI_BYTE, &status)) {
+                MPI_Get_count(&status, MPI_BYTE, &count);
+        }
+        if (sizeof(header) != count || 0 != memcmp(header.magic, STENCIL_MAGIC, sizeof(header.magic)) || sizeof(double) != header.value_size ||
+            header.count <= 0 || header.count > INT_MAX || header.steps < 0) {
+                MPI_File_close(file);
+                return 0;
+        }
+        *steps = header.steps;
+        return (int)header.count;
+}
+
+
+int open_snapshot(const char *output_name, MPI_Comm comm, MPI_File *file, int *slot, int64_t *steps) {
+        int num_values = 0;
+        *slot = -1;
+        for (int s = 0; s < 2; s++) {
+                char *name = snapshot_name(output_name, s);
+                MPI_File slot_file;
+                int64_t slot_steps;
+                int count = read_snapshot_header(name, comm, &slot_file, &slot_steps);
+                free(name);
+                if (0 == count) {
+                        continue;
+                }
+                if (0 < num_values && slot_steps <= *steps) {
+                        MPI_File_close(&slot_file);
+                        continue;
+                }
+                if (0 < num_values) {
+                        MPI_File_close(file);
+                }
+                *file = slot_file;
+                *slot = s;
+                *steps = slot_steps;
+                num_values = count;
+        }
+        return num_values;
+}
+
+
+int start_snapshots(snapshot_writer *writer, const char *output_name, int num_values, int resume_slot, MPI_Comm comm) {
+        memset(writer, 0, sizeof(*writer));
+        MPI_Comm_dup(comm, &writer->comm);
+        writer->slot = (0 == resume_slot) ? 1 : 0;
+        writer->num_values = num_values;
+        writer->completed = -1;
+        writer->request = MPI_REQUEST_NULL;
+
+        int id, result = 0;
+        MPI_Comm_rank(comm, &id);
+        for (int s = 0; s < 2; s++) {
+                char *name = snapshot_name(output_name, s);
+                int opened = (NULL != name && MPI_SUCCESS == MPI_File_open(writer->comm, name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &writer->file[s]));
+                int all_opened = opened;
+                MPI_Allreduce(MPI_IN_PLACE, &all_opened, 1, MPI_INT, MPI_LAND, writer->comm);
+                if (!all_opened) {
+                        if (opened) {
+                                MPI_File_close(&writer->file[s]);
+                        }
+                        if (id == 0) {
+                                fprintf(stderr, "Couldn't open snapshot file %s\n", NULL != name ? name : output_name);
+                        }
+                        writer->file[s] = MPI_FILE_NULL;
+                        result = -1;
+                } else if (resume_slot < 0) {
+                        MPI_File_set_size(writer->file[s], 0);
+                }
+                free(name);
+        }
+        if (0 != result) {
+                finish_snapshots(writer);
+        }
+        return result;
+}
+
+
+// The stages of a snapshot: the processes write their parts, the root
+// process learns whether all of them succeeded and writes the header, and
+// all processes learn the outcome.
+enum snapshot_stage { SNAPSHOT_IDLE, SNAPSHOT_WRITING, SNAPSHOT_REDUCING, SNAPSHOT_MARKING };
+
+// Advances the snapshot in flight, waiting for each stage if wait is set
+// and stopping at the first unfinished one otherwise
+static void advance_snapshot(snapshot_writer *writer, int wait) {
+        while (SNAPSHOT_IDLE != writer->stage) {
+                int done = 1;
+                MPI_Status status;
+                if (wait) {
+                        MPI_Wait(&writer->request, &status);
+                } else {
+                        MPI_Test(&writer->request, &done, &status);
+                }
+                if (!done) {
+                        return;
+                }
+
+                int id;
+                MPI_Comm_rank(writer->comm, &id);
+                if (SNAPSHOT_WRITING == writer->stage) {
+                        if (writer->ok) {
+                                int written = 0;
+                                MPI_Get_count(&status, MPI_DOUBLE, &written);
+                                writer->ok = (written == writer->count);
+                        }
+                        MPI_Ireduce(&writer->ok, &writer->all_ok, 1, MPI_INT, MPI_LAND, 0, writer->comm, &writer->request);
+                        writer->stage = SNAPSHOT_REDUCING;
+                } else if (SNAPSHOT_REDUCING == writer->stage) {
+                        // The header is written last, so a slot with a header holds a
+                        // whole snapshot, as far as the writes of this run reached the
+                        // file system; the parts aren't synced first (see stencil.h)
+                        writer->marked = -1;
+                        if (id == 0 && writer->all_ok) {
+                                stencil_file_header header;
+                                memset(&header, 0, sizeof(header));
+                                memcpy(header.magic, STENCIL_MAGIC, sizeof(STENCIL_MAGIC));
+                                header.count = writer->num_values;
+                                header.value_size = sizeof(double);
+                                header.version = 1;
+                                header.steps = writer->steps;
+                                if (MPI_SUCCESS == MPI_File_write_at(writer->file[writer->slot], 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE)) {
+                                        writer->marked = writer->steps;
+                                }
+                        }
+                        MPI_Ibcast(&writer->marked, 1, MPI_INT64_T, 0, writer->comm, &writer->request);
+                        writer->stage = SNAPSHOT_MARKING;
+                } else {
+                        if (writer->marked >= 0) {
+                                writer->completed = writer->marked;
+                        } else {
+                                writer->failed++;
+                                if (id == 0) {
+                                        fprintf(stderr, "Couldn't write the snapshot after %lld steps\n", (long long)writer->steps);
+                                }
+                        }
+                        // A failed snapshot leaves its slot cleared, and the next one
+                        // goes there again, so the other slot keeps the last complete one
+                        if (writer->marked >= 0) {
+                                writer->slot = 1 - writer->slot;
+                        }
+                        writer->stage = SNAPSHOT_IDLE;
+                }
+        }
+}
+
+
+void write_snapshot(snapshot_writer *writer, const double *values, int first, int count, int64_t steps) {
+        advance_snapshot(writer, 1);
+
+        // The parts can change size between snapshots when the processes are
+        // rebalanced
+        if (count > writer->capacity || NULL == writer->buffer) {
+                free(writer->buffer);
+                writer->buffer = malloc((count > 0 ? count : 1) * sizeof(double));
+                writer->capacity = (NULL != writer->buffer) ? count : 0;
+        }
+
+        // The root process clears the magic of the slot's old header before
+        // any part is overwritten, so a half written slot is never taken for
+        // a complete snapshot
+        int id, cleared = 1;
+        MPI_Comm_rank(writer->comm, &id);
+        if (id == 0) {
+                stencil_file_header header;
+                memset(&header, 0, sizeof(header));
+                cleared = (MPI_SUCCESS == MPI_File_write_at(writer->file[writer->slot], 0, header.magic, sizeof(header.magic), MPI_BYTE, MPI_STATUS_IGNORE));
+        }
+        MPI_Bcast(&cleared, 1, MPI_INT, 0, writer->comm);
+        writer->ok = cleared && (NULL != writer->buffer);
+        writer->count = count;
+        writer->steps = steps;
+        writer->request = MPI_REQUEST_NULL;
+        if (writer->ok) {
+                memcpy(writer->buffer, values, count * sizeof(double));
+                MPI_Offset offset = sizeof(stencil_file_header) + (MPI_Offset)first * sizeof(double);
+                writer->ok = (MPI_SUCCESS == MPI_File_iwrite_at(writer->file[writer->slot], offset, writer->buffer, count, MPI_DOUBLE, &writer->request));
+        }
+        writer->stage = SNAPSHOT_WRITING;
+}
+
+
+void progress_snapshot(snapshot_writer *writer) {
+        advance_snapshot(writer, 0);
+}
+
+
+int finish_snapshots(snapshot_writer *writer) {
+        advance_snapshot(writer, 1);
+        for (int s = 0; s < 2; s++) {
+                if (MPI_FILE_NULL != writer->file[s]) {
+                        MPI_File_close(&writer->file[s]);
+                }
+        }
+        MPI_Comm_free(&writer->comm);
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return (writer->failed > 0) ? -1 : 0;
+}
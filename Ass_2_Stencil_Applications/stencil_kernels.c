@@ -0,0 +1,299 @@
+/**
+ * Stencil kernels. apply_stencil is the reference and handles any width. For
+ * the common widths there are versions where the width is a compile time
+ * constant, so the loop over the coefficients is unrolled, and on x86 there
+ * are hand-vectorized versions of the five point stencil for SSE2, AVX2 and
+ * AVX-512, compiled with target attributes so the binary runs everywhere and
+ * the widest one the CPU supports is picked at startup.
+ */
+
+#include "stencil.h"
+#include <math.h>
+#include <string.h>
+
+int stencil_coefficients(int derivative, int width, double h, double *stencil) {
+	if (width < 3 || width % 2 == 0 || derivative < 0 || derivative >= width) {
+		return -1;
+	}
+	// Fornberg's recursion over the nodes x_j = j - width/2. weights[j][m]
+	// is the weight of node j for the m-th derivative at 0, using the nodes
+	// added so far.
+	int extent = width / 2;
+	double (*weights)[derivative + 1] = calloc(width, sizeof(*weights));
+	if (NULL == weights) {
+		return -1;
+	}
+	double c1 = 1, c4 = -extent;
+	weights[0][0] = 1;
+	for (int i = 1; i < width; i++) {
+		int orders = (i < derivative) ? i : derivative;
+		double c2 = 1, c5 = c4;
+		c4 = i - extent;
+		for (int j = 0; j < i; j++) {
+			double c3 = i - j;
+			c2 *= c3;
+			if (j == i - 1) {
+				for (int m = orders; m > 0; m--) {
+					weights[i][m] = c1 * (m * weights[i - 1][m - 1] - c5 * weights[i - 1][m]) / c2;
+				}
+				weights[i][0] = -c1 * c5 * weights[i - 1][0] / c2;
+			}
+			for (int m = orders; m > 0; m--) {
+				weights[j][m] = (c4 * weights[j][m] - m * weights[j][m - 1]) / c3;
+			}
+			weights[j][0] = c4 * weights[j][0] / c3;
+		}
+		c1 = c2;
+	}
+	double scale = pow(h, derivative);
+	for (int j = 0; j < width; j++) {
+		stencil[j] = weights[j][derivative] / scale;
+	}
+	free(weights);
+	return 0;
+}
+
+int compose_stencil(const double *stencil, int width, int times, double *composed) {
+	int composed_width = 1;
+	double *previous = malloc((times * (width - 1) + 1) * sizeof(double));
+	if (NULL == previous) {
+		return -1;
+	}
+	composed[0] = 1;
+	for (int t = 0; t < times; t++) {
+		for (int j = 0; j < composed_width; j++) {
+			previous[j] = composed[j];
+		}
+		for (int j = 0; j < composed_width + width - 1; j++) {
+			composed[j] = 0;
+		}
+		for (int j = 0; j < composed_width; j++) {
+			for (int k = 0; k < width; k++) {
+				composed[j + k] += previous[j] * stencil[k];
+			}
+		}
+		composed_width += width - 1;
+	}
+	free(previous);
+	return composed_width;
+}
+
+void apply_stencil(const double *input, double *output, int first, int last, const double *stencil, int extent) {
+	for (int i = first; i < last; i++) {
+		double result = 0;
+		for (int j = -extent; j <= extent; j++) {
+			result += stencil[j + extent] * input[i + j];
+		}
+		output[i] = result;
+	}
+}
+
+// Kernels for a fixed width. The constant trip count lets the compiler keep
+// the coefficients in registers and unroll the inner loop.
+#define DEFINE_FIXED_WIDTH_KERNEL(WIDTH) \
+static void apply_stencil##WIDTH(const double *input, double *output, int first, int last, const double *stencil, int extent) { \
+	(void)extent; \
+	double coefficients[WIDTH]; \
+	for (int j = 0; j < WIDTH; j++) { \
+		coefficients[j] = stencil[j]; \
+	} \
+	for (int i = first; i < last; i++) { \
+		double result = 0; \
+		_Pragma("GCC unroll 32") \
+		for (int j = 0; j < WIDTH; j++) { \
+			result += coefficients[j] * input[i + j - WIDTH / 2]; \
+		} \
+		output[i] = result; \
+	} \
+}
+
+DEFINE_FIXED_WIDTH_KERNEL(3)
+DEFINE_FIXED_WIDTH_KERNEL(5)
+DEFINE_FIXED_WIDTH_KERNEL(7)
+DEFINE_FIXED_WIDTH_KERNEL(9)
+DEFINE_FIXED_WIDTH_KERNEL(13)
+DEFINE_FIXED_WIDTH_KERNEL(17)
+DEFINE_FIXED_WIDTH_KERNEL(21)
+DEFINE_FIXED_WIDTH_KERNEL(25)
+
+// Kernels for interleaved signals. The stride between the values of a
+// signal is the number of signals, which follows from the extent. The loop
+// over the values vectorizes as it is, so on x86 it is also compiled for
+// AVX2 and AVX-512 and the version for the CPU is picked when the program
+// is loaded.
+#if defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+#define DEFINE_BATCH_KERNEL(WIDTH) \
+BATCH_TARGETS static void apply_batch_stencil##WIDTH(const double *input, double *output, int first, int last, const double *stencil, int extent) { \
+	const int stride = extent / (WIDTH / 2); \
+	double coefficients[WIDTH]; \
+	for (int j = 0; j < WIDTH; j++) { \
+		coefficients[j] = stencil[j]; \
+	} \
+	for (int i = first; i < last; i++) { \
+		double result = 0; \
+		_Pragma("GCC unroll 32") \
+		for (int j = 0; j < WIDTH; j++) { \
+			result += coefficients[j] * input[i + (j - WIDTH / 2) * stride]; \
+		} \
+		output[i] = result; \
+	} \
+}
+
+DEFINE_BATCH_KERNEL(3)
+DEFINE_BATCH_KERNEL(5)
+DEFINE_BATCH_KERNEL(7)
+DEFINE_BATCH_KERNEL(9)
+DEFINE_BATCH_KERNEL(13)
+DEFINE_BATCH_KERNEL(17)
+DEFINE_BATCH_KERNEL(21)
+DEFINE_BATCH_KERNEL(25)
+
+stencil_kernel select_batch_kernel(int width) {
+	switch (width) {
+	case 3: return apply_batch_stencil3;
+	case 5: return apply_batch_stencil5;
+	case 7: return apply_batch_stencil7;
+	case 9: return apply_batch_stencil9;
+	case 13: return apply_batch_stencil13;
+	case 17: return apply_batch_stencil17;
+	case 21: return apply_batch_stencil21;
+	case 25: return apply_batch_stencil25;
+	}
+	return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <stdint.h>
+
+// The vector loops store to aligned addresses. Input and output buffers are
+// allocated with the same alignment, so the load of the centre point is
+// aligned as well; the four shifted windows use unaligned loads, which cost
+// the same as aligned ones while they hit in L1.
+#define STENCIL5_POINT(i) \
+	(s0 * input[(i) - 2] + s1 * input[(i) - 1] + s2 * input[(i)] + s3 * input[(i) + 1] + s4 * input[(i) + 2])
+
+__attribute__((target("sse2")))
+static void apply_stencil5_sse2(const double *input, double *output, int first, int last, const double *stencil, int extent) {
+	(void)extent;
+	const double s0 = stencil[0], s1 = stencil[1], s2 = stencil[2], s3 = stencil[3], s4 = stencil[4];
+	const __m128d c0 = _mm_set1_pd(s0), c1 = _mm_set1_pd(s1), c2 = _mm_set1_pd(s2);
+	const __m128d c3 = _mm_set1_pd(s3), c4 = _mm_set1_pd(s4);
+	int i = first;
+	for (; i < last && ((uintptr_t)(output + i) & 15); i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+	for (; i + 2 <= last; i += 2) {
+		__m128d r = _mm_mul_pd(c0, _mm_loadu_pd(input + i - 2));
+		r = _mm_add_pd(r, _mm_mul_pd(c1, _mm_loadu_pd(input + i - 1)));
+		r = _mm_add_pd(r, _mm_mul_pd(c2, _mm_load_pd(input + i)));
+		r = _mm_add_pd(r, _mm_mul_pd(c3, _mm_loadu_pd(input + i + 1)));
+		r = _mm_add_pd(r, _mm_mul_pd(c4, _mm_loadu_pd(input + i + 2)));
+		_mm_store_pd(output + i, r);
+	}
+	for (; i < last; i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void apply_stencil5_avx2(const double *input, double *output, int first, int last, const double *stencil, int extent) {
+	(void)extent;
+	const double s0 = stencil[0], s1 = stencil[1], s2 = stencil[2], s3 = stencil[3], s4 = stencil[4];
+	const __m256d c0 = _mm256_set1_pd(s0), c1 = _mm256_set1_pd(s1), c2 = _mm256_set1_pd(s2);
+	const __m256d c3 = _mm256_set1_pd(s3), c4 = _mm256_set1_pd(s4);
+	int i = first;
+	for (; i < last && ((uintptr_t)(output + i) & 31); i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+	for (; i + 4 <= last; i += 4) {
+		__m256d r = _mm256_mul_pd(c0, _mm256_loadu_pd(input + i - 2));
+		r = _mm256_fmadd_pd(c1, _mm256_loadu_pd(input + i - 1), r);
+		r = _mm256_fmadd_pd(c2, _mm256_load_pd(input + i), r);
+		r = _mm256_fmadd_pd(c3, _mm256_loadu_pd(input + i + 1), r);
+		r = _mm256_fmadd_pd(c4, _mm256_loadu_pd(input + i + 2), r);
+		_mm256_store_pd(output + i, r);
+	}
+	for (; i < last; i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void apply_stencil5_avx512(const double *input, double *output, int first, int last, const double *stencil, int extent) {
+	(void)extent;
+	const double s0 = stencil[0], s1 = stencil[1], s2 = stencil[2], s3 = stencil[3], s4 = stencil[4];
+	const __m512d c0 = _mm512_set1_pd(s0), c1 = _mm512_set1_pd(s1), c2 = _mm512_set1_pd(s2);
+	const __m512d c3 = _mm512_set1_pd(s3), c4 = _mm512_set1_pd(s4);
+	int i = first;
+	for (; i < last && ((uintptr_t)(output + i) & 63); i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+	for (; i + 8 <= last; i += 8) {
+		__m512d r = _mm512_mul_pd(c0, _mm512_loadu_pd(input + i - 2));
+		r = _mm512_fmadd_pd(c1, _mm512_loadu_pd(input + i - 1), r);
+		r = _mm512_fmadd_pd(c2, _mm512_load_pd(input + i), r);
+		r = _mm512_fmadd_pd(c3, _mm512_loadu_pd(input + i + 1), r);
+		r = _mm512_fmadd_pd(c4, _mm512_loadu_pd(input + i + 2), r);
+		_mm512_store_pd(output + i, r);
+	}
+	for (; i < last; i++) {
+		output[i] = STENCIL5_POINT(i);
+	}
+}
+#endif
+
+stencil_kernel select_stencil_kernel(int width, const char *simd, const char **name) {
+	struct {
+		const char *name;
+		stencil_kernel kernel;
+		int supported;
+	} kernels[5] = {{"generic", apply_stencil, 1}};
+	int count = 1;
+	stencil_kernel fixed_width = NULL;
+	switch (width) {
+	case 3: fixed_width = apply_stencil3; break;
+	case 5: fixed_width = apply_stencil5; break;
+	case 7: fixed_width = apply_stencil7; break;
+	case 9: fixed_width = apply_stencil9; break;
+	case 13: fixed_width = apply_stencil13; break;
+	case 17: fixed_width = apply_stencil17; break;
+	case 21: fixed_width = apply_stencil21; break;
+	case 25: fixed_width = apply_stencil25; break;
+	}
+	if (NULL != fixed_width) {
+		kernels[count].name = "scalar";
+		kernels[count].kernel = fixed_width;
+		kernels[count++].supported = 1;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	if (5 == width) {
+		__builtin_cpu_init();
+		kernels[count].name = "sse2";
+		kernels[count].kernel = apply_stencil5_sse2;
+		kernels[count++].supported = __builtin_cpu_supports("sse2");
+		kernels[count].name = "avx2";
+		kernels[count].kernel = apply_stencil5_avx2;
+		kernels[count++].supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		kernels[count].name = "avx512";
+		kernels[count].kernel = apply_stencil5_avx512;
+		kernels[count++].supported = __builtin_cpu_supports("avx512f");
+	}
+#endif
+	for (int k = count - 1; k >= 0; k--) {
+		if (NULL == simd ? kernels[k].supported : 0 == strcmp(simd, kernels[k].name)) {
+			if (!kernels[k].supported) {
+				break;
+			}
+			if (NULL != name) {
+				*name = kernels[k].name;
+			}
+			return kernels[k].kernel;
+		}
+	}
+	return NULL;
+}
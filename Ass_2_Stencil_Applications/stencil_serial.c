@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
 #include "stencil.h"
+#include <string.h>
 
 
 int main(int argc, char **argv) {
@@ -21,52 +23,38 @@ int main(int argc, char **argv) {
 	double h = 2.0*PI/num_values;
 	const int STENCIL_WIDTH = 5;
 	const int EXTENT = STENCIL_WIDTH/2;
-	const double STENCIL[] = {1.0/(12*h), -8.0/(12*h), 0.0, 8.0/(12*h), -1.0/(12*h)};
+	double STENCIL[STENCIL_WIDTH];
+	stencil_coefficients(1, STENCIL_WIDTH, h, STENCIL);
+
+	stencil_kernel kernel = select_stencil_kernel(STENCIL_WIDTH, NULL, NULL);
 
 	// Start timer
 	double start = MPI_Wtime();
 
-	// Allocate data for result
-	double *output;
-	if (NULL == (output = malloc(num_values * sizeof(double)))) {
-		perror("Couldn't allocate memory for output");
-		return 2;
+	// The vector is periodic, so the stencil is applied to a copy with EXTENT
+	// wrapped-around values at each end instead of computing indices modulo
+	// num_values. Input and output are swapped after each application.
+	double *extended[2];
+	for (int b=0; b<2; b++) {
+		if (0 != posix_memalign((void **)&extended[b], STENCIL_ALIGNMENT, (num_values + 2*EXTENT) * sizeof(double))) {
+			perror("Couldn't allocate memory for output");
+			return 2;
+		}
 	}
+	memcpy(extended[0] + EXTENT, input, num_values * sizeof(double));
+	free(input);
+	int current = 0;
 	// Repeatedly apply stencil
 	for (int s=0; s<num_steps; s++) {
-		// Apply stencil
+		double *values = extended[current];
 		for (int i=0; i<EXTENT; i++) {
-			double result = 0;
-			for (int j=0; j<STENCIL_WIDTH; j++) {
-				int index = (i - EXTENT + j + num_values) % num_values;
-				result += STENCIL[j] * input[index];
-			}
-			output[i] = result;
-		}
-		for (int i=EXTENT; i<num_values-EXTENT; i++) {
-			double result = 0;
-			for (int j=0; j<STENCIL_WIDTH; j++) {
-				int index = i - EXTENT + j;
-				result += STENCIL[j] * input[index];
-			}
-			output[i] = result;
-		}
-		for (int i=num_values-EXTENT; i<num_values; i++) {
-			double result = 0;
-			for (int j=0; j<STENCIL_WIDTH; j++) {
-				int index = (i - EXTENT + j) % num_values;
-				result += STENCIL[j] * input[index];
-			}
-			output[i] = result;
-		}
-		// Swap input and output
-		if (s < num_steps-1) {
-			double *tmp = input;
-			input = output;
-			output = tmp;
+			values[i] = values[num_values + i];
+			values[num_values + EXTENT + i] = values[EXTENT + i];
 		}
+		kernel(values, extended[1 - current], EXTENT, num_values + EXTENT, STENCIL, EXTENT);
+		current = 1 - current;
 	}
-	free(input);
+	double *output = extended[current] + EXTENT;
 	// Stop timer
 	double my_execution_time = MPI_Wtime() - start;
 
@@ -79,7 +67,8 @@ int main(int argc, char **argv) {
 #endif
 
 	// Clean up
-	free(output);
+	free(extended[0]);
+	free(extended[1]);
 
 	return 0;
 }
@@ -1,36 +1,107 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
 
 int compare(const void* a, const void* b) {
-    return (*(long long*)a - *(long long*)b);
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
 }
 
+// LSD radix sort of signed 64-bit keys. Flipping the sign bit makes the
+// keys sort as unsigned numbers. The digits are 8, 11 or 16 bits wide
+// depending on n, so the counts stay in cache while there are few keys to
+// spread them over. All histograms are counted in one pass, and a digit
+// that is the same in every key is skipped. The passes alternate between
+// the keys and a scratch buffer. Falls back to qsort if out of memory.
+void radix_sort(long long *keys, int n) {
+    const unsigned long long SIGN = 1ULL << 63;
+    const int bits = (n < (1 << 16)) ? 8 : (n < (1 << 24)) ? 11 : 16;
+    const int buckets = 1 << bits, passes = (64 + bits - 1) / bits;
+    const unsigned long long mask = buckets - 1;
+    if (n < 2) {
+        return;
+    }
+    long long *scratch = (long long *)malloc(n * sizeof(long long));
+    int *counts = (int *)calloc((size_t)passes * buckets, sizeof(int));
+    if (!scratch || !counts) {
+        free(scratch);
+        free(counts);
+        qsort(keys, n, sizeof(long long), compare);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        unsigned long long key = (unsigned long long)keys[i] ^ SIGN;
+        for (int d = 0; d < passes; d++) {
+            counts[d * buckets + ((key >> (d * bits)) & mask)]++;
+        }
+    }
+
+    long long *from = keys, *to = scratch;
+    for (int d = 0; d < passes; d++) {
+        int *count = counts + d * buckets;
+        if (count[((unsigned long long)keys[0] ^ SIGN) >> (d * bits) & mask] == n) {
+            continue;
+        }
+        // Turn the counts into the first position of each bucket
+        int position = 0;
+        for (int b = 0; b < buckets; b++) {
+            int size = count[b];
+            count[b] = position;
+            position += size;
+        }
+        for (int i = 0; i < n; i++) {
+            unsigned long long key = (unsigned long long)from[i] ^ SIGN;
+            to[count[(key >> (d * bits)) & mask]++] = from[i];
+        }
+        long long *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != keys) {
+        memcpy(keys, from, n * sizeof(long long));
+    }
+    free(scratch);
+    free(counts);
+}
+
+// Every rank's median, if its chunk isn't empty, is gathered on the group's
+// root, which picks the pivot of the whole group: the median of the first
+// rank with keys, normally the root itself (strategy 1), the median of the
+// medians (2) or their mean (3). The chunk must be sorted.
 long long calculate_pivot(long long *chunk, int chunk_size, int id, int p, int pivot_strategy, MPI_Comm comm) {
-    long long median, final_pivot = 0;
-    qsort(chunk, chunk_size, sizeof(long long), compare);
-    median = (chunk_size % 2 == 0) ? (chunk[chunk_size / 2 - 1] + chunk[chunk_size / 2]) / 2 : chunk[chunk_size / 2];
+    long long median[2] = {0, chunk_size > 0}, final_pivot = 0;
+    if (chunk_size > 0) {
+        // Halving the unsigned difference can't overflow
+        unsigned long long a = chunk[(chunk_size - 1) / 2], b = chunk[chunk_size / 2];
+        median[0] = (long long)(a + (b - a) / 2);
+    }
+    long long *medians = NULL;
+    if (id == 0) medians = (long long *)malloc(2 * p * sizeof(long long));
+    MPI_Gather(median, 2, MPI_LONG_LONG, medians, 2, MPI_LONG_LONG, 0, comm);
 
-    if (pivot_strategy == 1) { 
-        final_pivot = median;
-    } else {
-        long long *medians = NULL;
-        if (id == 0) medians = (long long *)malloc(p * sizeof(long long));
-        MPI_Gather(&median, 1, MPI_LONG_LONG, medians, 1, MPI_LONG_LONG, 0, comm);
-
-        if (id == 0) {
-            if (pivot_strategy == 2) {  // Median of medians
-                qsort(medians, p, sizeof(long long), compare);
-                final_pivot = medians[p / 2];
-            } else if (pivot_strategy == 3) {  // Mean of medians
-                long long sum = 0;
-                for (int i = 0; i < p; i++) sum += medians[i];
-                final_pivot = sum / p;
-            }
-            free(medians);
+    if (id == 0) {
+        int k = 0;
+        for (int i = 0; i < p; i++) {
+            if (medians[2 * i + 1]) medians[k++] = medians[2 * i];
+        }
+        if (k == 0) {
+            final_pivot = 0;
+        } else if (pivot_strategy == 1) {
+            final_pivot = medians[0];
+        } else if (pivot_strategy == 2) {  // Median of medians
+            qsort(medians, k, sizeof(long long), compare);
+            final_pivot = medians[k / 2];
+        } else if (pivot_strategy == 3) {  // Mean of medians
+            long double sum = 0;
+            for (int i = 0; i < k; i++) sum += medians[i];
+            final_pivot = (long long)(sum / k);
         }
-        MPI_Bcast(&final_pivot, 1, MPI_LONG_LONG, 0, comm); 
+        free(medians);
     }
+    MPI_Bcast(&final_pivot, 1, MPI_LONG_LONG, 0, comm);
     return final_pivot;
 }
 
@@ -60,6 +131,452 @@ void exchange_chunks(long long *chunk, int size, int low, int high, int pair, in
     MPI_Wait(&request_recv, &status);
 }
 
+// Returns the number of keys in the sorted array that are less than value
+int lower_bound(const long long *keys, int n, long long value) {
+    int low = 0, high = n;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (keys[middle] < value) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Returns the number of keys in the sorted array that are at most value
+int upper_bound(const long long *keys, int n, long long value) {
+    int low = 0, high = n;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (keys[middle] <= value) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// The hypercube quicksort: in each round the group agrees on a pivot, the
+// lower half of the group swaps its keys above the pivot for the upper
+// half's keys below it, and each half goes on as a group of its own. The
+// number of processes must be a power of two.
+void hypercube_sort(long long **chunk_ptr, int *chunk_size_ptr, int id, int p, int pivot_strategy) {
+    long long *chunk = *chunk_ptr, *temp;
+    int chunk_size = *chunk_size_ptr;
+    int group_size = p;
+    int group_id = id;
+    long long pivot;
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    while (group_size > 1) {
+        pivot = calculate_pivot(chunk, chunk_size, group_id, group_size, pivot_strategy, comm);
+
+        // The keys below the pivot go to the lower half of the group
+        int low = lower_bound(chunk, chunk_size, pivot);
+        int high = chunk_size - low;
+
+        int pair;
+        if (group_id < group_size / 2) {
+            pair = group_id + group_size / 2;
+        } else {
+            pair = group_id - group_size / 2;
+        }
+
+        int new_size;
+        long long *new_chunk = NULL;
+        
+        if (group_id < group_size / 2) {
+            exchange_chunks(chunk, chunk_size, low, high, pair, 0, comm, &new_size, &new_chunk);
+        } else {
+            exchange_chunks(chunk, chunk_size, 0, low, pair, 1, comm, &new_size, &new_chunk);
+        }
+
+        if (group_id < group_size / 2) {
+            chunk_size = low + new_size;
+            temp = merge(chunk, low, new_chunk, new_size);
+        } else {
+            chunk_size = high + new_size;
+            temp = merge(chunk + low, high, new_chunk, new_size);
+        }
+
+        free(chunk);
+        chunk = temp;
+
+        MPI_Comm newcomm;
+        MPI_Comm_split(comm, group_id < group_size / 2, group_id, &newcomm);
+        MPI_Comm_rank(newcomm, &group_id);
+        MPI_Comm_size(newcomm, &group_size);
+        if (comm != MPI_COMM_WORLD) MPI_Comm_free(&comm);
+        comm = newcomm;
+
+        free(new_chunk);
+    }
+    if (comm != MPI_COMM_WORLD) MPI_Comm_free(&comm);
+
+    *chunk_ptr = chunk;
+    *chunk_size_ptr = chunk_size;
+}
+
+// Merges the p sorted runs of keys, the i-th of counts[i] keys starting at
+// displs[i], into result with a binary heap of the runs' smallest keys
+void merge_runs(const long long *keys, const int *counts, const int *displs, int p, long long *result) {
+    int *heap = (int *)malloc(p * sizeof(int));
+    int *next = (int *)malloc(p * sizeof(int));
+    int size = 0, k = 0;
+    for (int i = 0; i < p; i++) {
+        next[i] = displs[i];
+        if (counts[i] == 0) continue;
+        // Sift the new run up
+        int j = size++;
+        while (j > 0 && keys[next[heap[(j - 1) / 2]]] > keys[next[i]]) {
+            heap[j] = heap[(j - 1) / 2];
+            j = (j - 1) / 2;
+        }
+        heap[j] = i;
+    }
+    while (size > 0) {
+        int run = heap[0];
+        result[k++] = keys[next[run]++];
+        if (next[run] == displs[run] + counts[run]) run = heap[--size];
+        // Sift the run down from the top
+        int j = 0;
+        while (2 * j + 1 < size) {
+            int child = 2 * j + 1;
+            if (child + 1 < size && keys[next[heap[child + 1]]] < keys[next[heap[child]]]) child++;
+            if (keys[next[heap[child]]] >= keys[next[run]]) break;
+            heap[j] = heap[child];
+            j = child;
+        }
+        if (size > 0) heap[j] = run;
+    }
+    free(heap);
+    free(next);
+}
+
+// Sends the keys of the sorted chunk before ends[0] to rank 0, the ones
+// from there to ends[1] to rank 1 and so on, in a single MPI_Alltoallv, and
+// merges the received runs into the new sorted chunk
+void exchange_by_ends(long long **chunk, int *chunk_size, const int *ends, int p, MPI_Comm comm) {
+    int *send_counts = (int *)malloc(4 * p * sizeof(int));
+    if (!send_counts) {
+        fprintf(stderr, "Memory allocation failed\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    int *send_displs = send_counts + p, *recv_counts = send_counts + 2 * p, *recv_displs = send_counts + 3 * p;
+    int previous = 0;
+    for (int i = 0; i < p; i++) {
+        int end = (i < p - 1) ? ends[i] : *chunk_size;
+        if (end < previous) end = previous;
+        send_displs[i] = previous;
+        send_counts[i] = end - previous;
+        previous = end;
+    }
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, comm);
+    int total = 0;
+    for (int i = 0; i < p; i++) {
+        recv_displs[i] = total;
+        total += recv_counts[i];
+    }
+    long long *received = (long long *)malloc((total > 0 ? total : 1) * sizeof(long long));
+    long long *merged = (long long *)malloc((total > 0 ? total : 1) * sizeof(long long));
+    if (!received || !merged) {
+        fprintf(stderr, "Memory allocation failed\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Alltoallv(*chunk, send_counts, send_displs, MPI_LONG_LONG, received, recv_counts, recv_displs, MPI_LONG_LONG, comm);
+    merge_runs(received, recv_counts, recv_displs, p, merged);
+    free(received);
+    free(send_counts);
+    free(*chunk);
+    *chunk = merged;
+    *chunk_size = total;
+}
+
+// Sends every key to the rank whose range holds it, rank i getting the keys
+// above splitters[i-1] and at most splitters[i]
+void exchange_by_splitters(long long **chunk, int *chunk_size, const long long *splitters, int p, MPI_Comm comm) {
+    int *ends = (int *)malloc(p * sizeof(int));
+    for (int i = 0; i < p - 1; i++) {
+        ends[i] = upper_bound(*chunk, *chunk_size, splitters[i]);
+    }
+    exchange_by_ends(chunk, chunk_size, ends, p, comm);
+    free(ends);
+}
+
+// Parallel sorting by regular sampling: every rank contributes p evenly
+// spaced keys of its sorted chunk, and the keys at every p-th position of
+// all samples, sorted, split the keys into p ranges of at most about 2n/p
+// keys each. Works for any number of processes.
+void sample_sort(long long **chunk, int *chunk_size, int p, MPI_Comm comm) {
+    if (p == 1) return;
+    int num_samples = (*chunk_size < p) ? *chunk_size : p;
+    int *sample_counts = (int *)malloc(2 * p * sizeof(int));
+    int *sample_displs = sample_counts + p;
+    MPI_Allgather(&num_samples, 1, MPI_INT, sample_counts, 1, MPI_INT, comm);
+    int total_samples = 0;
+    for (int i = 0; i < p; i++) {
+        sample_displs[i] = total_samples;
+        total_samples += sample_counts[i];
+    }
+    long long *samples = (long long *)malloc(p * sizeof(long long));
+    long long *all_samples = (long long *)malloc((total_samples > 0 ? total_samples : 1) * sizeof(long long));
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = (*chunk)[(long long)i * *chunk_size / num_samples];
+    }
+    MPI_Allgatherv(samples, num_samples, MPI_LONG_LONG, all_samples, sample_counts, sample_displs, MPI_LONG_LONG, comm);
+    radix_sort(all_samples, total_samples);
+
+    long long *splitters = (long long *)malloc(p * sizeof(long long));
+    for (int i = 0; i < p - 1; i++) {
+        splitters[i] = (total_samples > 0) ? all_samples[(long long)(i + 1) * total_samples / p] : 0;
+    }
+    exchange_by_splitters(chunk, chunk_size, splitters, p, comm);
+    free(splitters);
+    free(samples);
+    free(all_samples);
+    free(sample_counts);
+}
+
+// Exact splitters from global rank histograms. The i-th splitter is the
+// key below which the (i+1)*n/p-th smallest key lies, found by bisection
+// over the key range: every round each rank counts its keys below and up
+// to the candidate of every splitter by binary search, and one
+// MPI_Allreduce sums the counts. A splitter is done once its count is
+// within epsilon*n/(2p) of its target, or its key is found. The copies of
+// a splitter key are then divided between the two sides in rank order, so
+// every rank ends up with n/p keys, give or take epsilon*n/p, even if one
+// key fills several ranks. Works for any number of processes.
+void histogram_sort(long long **chunk, int *chunk_size, int p, double epsilon, MPI_Comm comm) {
+    if (p == 1) return;
+    const int m = p - 1;
+    long long n = *chunk_size;
+    long long smallest = (*chunk_size > 0) ? (*chunk)[0] : LLONG_MAX;
+    long long largest = (*chunk_size > 0) ? (*chunk)[*chunk_size - 1] : LLONG_MIN;
+    MPI_Allreduce(MPI_IN_PLACE, &n, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &smallest, 1, MPI_LONG_LONG, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &largest, 1, MPI_LONG_LONG, MPI_MAX, comm);
+    const long long tolerance = (long long)(epsilon * n / (2.0 * p));
+
+    long long *low = (long long *)malloc(3 * m * sizeof(long long));
+    long long *high = low + m, *candidate = low + 2 * m;
+    long long *counts = (long long *)malloc(4 * m * sizeof(long long));
+    long long *below = counts, *up_to = counts + m, *target = counts + 2 * m, *before = counts + 3 * m;
+    int *done = (int *)calloc(m, sizeof(int));
+    for (int i = 0; i < m; i++) {
+        low[i] = smallest;
+        high[i] = largest;
+        candidate[i] = smallest;
+        target[i] = n * (i + 1) / p;
+    }
+    int remaining = (n > 0) ? m : 0;
+    while (remaining > 0) {
+        for (int i = 0; i < m; i++) {
+            if (!done[i]) {
+                // The midpoint in unsigned arithmetic can't overflow
+                unsigned long long l = (unsigned long long)low[i] ^ (1ULL << 63), h = (unsigned long long)high[i] ^ (1ULL << 63);
+                candidate[i] = (long long)((l + (h - l) / 2) ^ (1ULL << 63));
+            }
+            below[i] = lower_bound(*chunk, *chunk_size, candidate[i]);
+            up_to[i] = upper_bound(*chunk, *chunk_size, candidate[i]);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, counts, 2 * m, MPI_LONG_LONG, MPI_SUM, comm);
+        remaining = 0;
+        for (int i = 0; i < m; i++) {
+            if (done[i]) continue;
+            long long miss = up_to[i] - target[i];
+            if ((miss <= tolerance && miss >= -tolerance) || (below[i] <= target[i] && target[i] <= up_to[i])) {
+                done[i] = 1;
+            } else if (up_to[i] < target[i]) {
+                low[i] = candidate[i] + 1;
+            } else {
+                high[i] = candidate[i] - 1;
+            }
+            remaining += !done[i];
+        }
+    }
+
+    // Of the keys equal to a splitter, the ones that bring the count below
+    // it up to the target stay on its lower side, taken from the ranks in
+    // order
+    int *ends = (int *)malloc(p * sizeof(int));
+    long long *equal = (long long *)malloc(m * sizeof(long long));
+    for (int i = 0; i < m; i++) {
+        int first = lower_bound(*chunk, *chunk_size, candidate[i]);
+        equal[i] = upper_bound(*chunk, *chunk_size, candidate[i]) - first;
+        ends[i] = first;
+        before[i] = 0;
+    }
+    MPI_Exscan(equal, before, m, MPI_LONG_LONG, MPI_SUM, comm);
+    int id;
+    MPI_Comm_rank(comm, &id);
+    for (int i = 0; i < m; i++) {
+        long long needed = target[i] - below[i] - (id > 0 ? before[i] : 0);
+        ends[i] += (needed < 0) ? 0 : (needed > equal[i]) ? equal[i] : needed;
+    }
+    exchange_by_ends(chunk, chunk_size, ends, p, comm);
+    free(ends);
+    free(equal);
+    free(low);
+    free(counts);
+    free(done);
+}
+
+// Moves keys between ranks so that rank r ends up with the keys at global
+// positions r*n/p to (r+1)*n/p, floor or ceil of n/p of them. The global
+// position of every rank's first key is the prefix sum of the sizes, and a
+// rank only exchanges keys with the ranks whose old range overlaps its new
+// one, which for a mild imbalance are its neighbours. The ranges stay in
+// order, so the received pieces are simply concatenated.
+void rebalance(long long **chunk, int *chunk_size, int id, int p, MPI_Comm comm) {
+    int *sizes = (int *)malloc(p * sizeof(int));
+    long long *starts = (long long *)malloc((p + 1) * sizeof(long long));
+    MPI_Allgather(chunk_size, 1, MPI_INT, sizes, 1, MPI_INT, comm);
+    starts[0] = 0;
+    for (int r = 0; r < p; r++) {
+        starts[r + 1] = starts[r] + sizes[r];
+    }
+    const long long n = starts[p];
+
+    // Rank r's new range is [r*n/p, (r+1)*n/p)
+    long long first = (long long)id * n / p, last = (long long)(id + 1) * n / p;
+    long long *moved = (long long *)malloc((last > first ? last - first : 1) * sizeof(long long));
+    MPI_Request *requests = (MPI_Request *)malloc(2 * p * sizeof(MPI_Request));
+    int num_requests = 0;
+    for (int r = 0; r < p; r++) {
+        long long r_first = (long long)r * n / p, r_last = (long long)(r + 1) * n / p;
+        // Keys of this rank that belong to rank r
+        long long from = (starts[id] > r_first) ? starts[id] : r_first;
+        long long to = (starts[id + 1] < r_last) ? starts[id + 1] : r_last;
+        if (from < to) {
+            if (r == id) {
+                memcpy(moved + (from - first), *chunk + (from - starts[id]), (to - from) * sizeof(long long));
+            } else {
+                MPI_Isend(*chunk + (from - starts[id]), (int)(to - from), MPI_LONG_LONG, r, 2, comm, &requests[num_requests++]);
+            }
+        }
+        // Keys of rank r that belong to this rank
+        from = (starts[r] > first) ? starts[r] : first;
+        to = (starts[r + 1] < last) ? starts[r + 1] : last;
+        if (r != id && from < to) {
+            MPI_Irecv(moved + (from - first), (int)(to - from), MPI_LONG_LONG, r, 2, comm, &requests[num_requests++]);
+        }
+    }
+    MPI_Waitall(num_requests, requests, MPI_STATUSES_IGNORE);
+    free(*chunk);
+    *chunk = moved;
+    *chunk_size = (int)(last - first);
+    free(requests);
+    free(sizes);
+    free(starts);
+}
+
+// Returns the largest chunk over the average chunk
+double size_imbalance(int chunk_size, MPI_Comm comm) {
+    long long sizes[2] = {chunk_size, chunk_size};
+    int p;
+    MPI_Comm_size(comm, &p);
+    MPI_Allreduce(MPI_IN_PLACE, &sizes[0], 1, MPI_LONG_LONG, MPI_MAX, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &sizes[1], 1, MPI_LONG_LONG, MPI_SUM, comm);
+    return (sizes[1] > 0) ? (double)sizes[0] * p / sizes[1] : 1.0;
+}
+
+// Longest text of a key, "-9223372036854775808 "
+#define KEY_TEXT_MAX 21
+
+// Returns the length of the text of a key, with the trailing space
+int key_length(long long key) {
+    unsigned long long magnitude = (key < 0) ? 0 - (unsigned long long)key : (unsigned long long)key;
+    int length = (key < 0) + 2;
+    while (magnitude >= 10) {
+        magnitude /= 10;
+        length++;
+    }
+    return length;
+}
+
+// Writes a key like fprintf(file, "%lld ", key) and returns its length
+int format_key(long long key, char *text) {
+    unsigned long long magnitude = (key < 0) ? 0 - (unsigned long long)key : (unsigned long long)key;
+    char reversed[KEY_TEXT_MAX];
+    int length = 0, written = 0;
+    do {
+        reversed[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (key < 0) text[written++] = '-';
+    while (length > 0) text[written++] = reversed[--length];
+    text[written++] = ' ';
+    return written;
+}
+
+// Keys formatted and written per round of the text output
+#define KEYS_PER_WRITE (1 << 20)
+
+// Writes the keys of all ranks, in rank order, to a text file like the
+// root's fprintf loop would. Each rank works out the length of its text,
+// MPI_Exscan gives the offset of its text in the file, and the ranks format
+// and write their keys in rounds of KEYS_PER_WRITE keys, so the buffer stays
+// small, with collective MPI-IO writes. Returns 0 on success, -1 on error.
+int write_text_output(const char *file_name, const long long *keys, int count, MPI_Comm comm) {
+    int id, p;
+    MPI_Comm_rank(comm, &id);
+    MPI_Comm_size(comm, &p);
+    long long length = (id == p - 1), offset = 0;
+    for (int i = 0; i < count; i++) {
+        length += key_length(keys[i]);
+    }
+    MPI_Exscan(&length, &offset, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    if (id == 0) offset = 0;
+    // At least one round, in which the last rank ends the file with a
+    // newline even if there are no keys at all
+    int rounds = (count > 0) ? (count + KEYS_PER_WRITE - 1) / KEYS_PER_WRITE : 1;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_INT, MPI_MAX, comm);
+
+    MPI_File file;
+    if (MPI_SUCCESS != MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file)) {
+        if (id == 0) fprintf(stderr, "Failed to open file %s\n", file_name);
+        return -1;
+    }
+    char *text = (char *)malloc((size_t)(count < KEYS_PER_WRITE ? count : KEYS_PER_WRITE) * KEY_TEXT_MAX + 1);
+    int ok = (text != NULL) && MPI_SUCCESS == MPI_File_set_size(file, 0);
+    for (int round = 0; round < rounds; round++) {
+        int first = round * KEYS_PER_WRITE;
+        int last = (first + KEYS_PER_WRITE < count) ? first + KEYS_PER_WRITE : count;
+        int written = 0;
+        for (int i = first; ok && i < last; i++) {
+            written += format_key(keys[i], text + written);
+        }
+        if (ok && id == p - 1 && round == rounds - 1) text[written++] = '\n';
+        ok &= MPI_SUCCESS == MPI_File_write_at_all(file, offset, text, ok ? written : 0, MPI_CHAR, MPI_STATUS_IGNORE);
+        offset += written;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+    if (!ok && id == 0) fprintf(stderr, "Failed to write file %s\n", file_name);
+    MPI_File_close(&file);
+    free(text);
+    return ok ? 0 : -1;
+}
+
+// Writes the keys of all ranks, in rank order, to a binary file of 64-bit
+// keys in native byte order, with one collective MPI-IO write. Returns 0 on
+// success, -1 on error.
+int write_binary_output(const char *file_name, const long long *keys, int count, MPI_Comm comm) {
+    int id;
+    MPI_Comm_rank(comm, &id);
+    long long first = 0, local_count = count;
+    MPI_Exscan(&local_count, &first, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    if (id == 0) first = 0;
+
+    MPI_File file;
+    if (MPI_SUCCESS != MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file)) {
+        if (id == 0) fprintf(stderr, "Failed to open file %s\n", file_name);
+        return -1;
+    }
+    int ok = MPI_SUCCESS == MPI_File_set_size(file, 0);
+    ok &= MPI_SUCCESS == MPI_File_write_at_all(file, (MPI_Offset)first * sizeof(long long), keys, count, MPI_LONG_LONG, MPI_STATUS_IGNORE);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, comm);
+    if (!ok && id == 0) fprintf(stderr, "Failed to write file %s\n", file_name);
+    MPI_File_close(&file);
+    return ok ? 0 : -1;
+}
+
 int main(int argc, char** argv) {
     int id, p, n, *send_counts, *displacements, chunk_size, remainder;
     long long *data, *chunk, *temp, *other;
@@ -68,13 +585,37 @@ int main(int argc, char** argv) {
     MPI_Comm_rank(MPI_COMM_WORLD, &id);
     MPI_Comm_size(MPI_COMM_WORLD, &p);
 
-    if (argc != 4) {
-        if (id == 0) fprintf(stderr, "Usage: %s <input_file> <output_file> <pivot_strategy>\n", argv[0]);
+    double epsilon = 0;
+    int balance = 0;
+    const char *output_format = "text";
+    int bad_arguments = argc < 4;
+    for (int i = 4; i < argc && !bad_arguments; i++) {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            epsilon = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            balance = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_format = argv[++i];
+            bad_arguments = strcmp(output_format, "text") && strcmp(output_format, "binary") && strcmp(output_format, "tree");
+        } else {
+            bad_arguments = 1;
+        }
+    }
+    if (bad_arguments) {
+        if (id == 0) fprintf(stderr, "Usage: %s <input_file> <output_file> <pivot_strategy> [-e epsilon] [-r] [-o text|binary|tree]\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
 
+    // Strategies 1-3 pick the pivots of the hypercube quicksort, which
+    // halves the process groups; 4 (PSRS) and 5 (histogram splitters) need
+    // no halving
     int pivot_strategy = atoi(argv[3]);
+    if (pivot_strategy < 1 || pivot_strategy > 5 || (pivot_strategy < 4 && (p & (p - 1)) != 0)) {
+        if (id == 0) fprintf(stderr, "Pivot strategy must be 1, 2 or 3 on a power of two processes, or 4 (PSRS) or 5 (histogram) on any number\n");
+        MPI_Finalize();
+        return 1;
+    }
 
     if (id == 0) {
         FILE *fp = fopen(argv[1], "r");
@@ -135,66 +676,34 @@ int main(int argc, char** argv) {
     double start_time = MPI_Wtime();
     double max_time = 0.0;
 
-    if (p == 1) {
-        qsort(chunk, chunk_size, sizeof(long long), compare);
-        max_time = MPI_Wtime() - start_time;
-    } else {
-        int group_size = p;
-        int group_id = id;
-        long long pivot;
-        MPI_Comm comm = MPI_COMM_WORLD;
-
-        while (group_size > 1) {
-            pivot = calculate_pivot(chunk, chunk_size, group_id, group_size, pivot_strategy, comm);
-
-            int pivotIndex = chunk_size / 2;
-            while (pivotIndex > 0 && chunk[pivotIndex] >= pivot) {
-                pivotIndex--;
-            }
-            int low = pivotIndex;
-            int high = chunk_size - pivotIndex;
-
-            int pair;
-            if (group_id < group_size / 2) {
-                pair = group_id + group_size / 2;
-            } else {
-                pair = group_id - group_size / 2;
-            }
-
-            int new_size;
-            long long *new_chunk = NULL;
-            
-            if (group_id < group_size / 2) {
-                exchange_chunks(chunk, chunk_size, low, high, pair, 0, comm, &new_size, &new_chunk);
-            } else {
-                exchange_chunks(chunk, chunk_size, 0, low, pair, 1, comm, &new_size, &new_chunk);
-            }
-
-            if (group_id < group_size / 2) {
-                chunk_size = low + new_size;
-                temp = merge(chunk, low, new_chunk, new_size);
-            } else {
-                chunk_size = high + new_size;
-                temp = merge(chunk + low, high, new_chunk, new_size);
-            }
+    // Every rank sorts its chunk once; the merges keep it sorted after that
+    radix_sort(chunk, chunk_size);
 
-            free(chunk);
-            chunk = temp;
+    if (pivot_strategy == 4) {
+        sample_sort(&chunk, &chunk_size, p, MPI_COMM_WORLD);
+    } else if (pivot_strategy == 5) {
+        histogram_sort(&chunk, &chunk_size, p, epsilon, MPI_COMM_WORLD);
+    } else {
+        hypercube_sort(&chunk, &chunk_size, id, p, pivot_strategy);
+    }
 
-            MPI_Comm newcomm;
-            MPI_Comm_split(comm, group_id < group_size / 2, group_id, &newcomm);
-            MPI_Comm_rank(newcomm, &group_id);
-            MPI_Comm_size(newcomm, &group_size);
-            comm = newcomm;
+    // With -r every rank ends up with n/p of the sorted keys
+    double imbalance[2] = {0, 0};
+    if (balance) {
+        imbalance[0] = size_imbalance(chunk_size, MPI_COMM_WORLD);
+        rebalance(&chunk, &chunk_size, id, p, MPI_COMM_WORLD);
+        imbalance[1] = size_imbalance(chunk_size, MPI_COMM_WORLD);
+    }
 
-            free(new_chunk);
-        }
+    double elapsed_time = MPI_Wtime() - start_time;
+    // The maximum time taken by any process
+    MPI_Allreduce(&elapsed_time, &max_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
 
-        double end_time = MPI_Wtime();
-        double elapsed_time = end_time - start_time;
-        // The maximum time taken by any process
-        MPI_Allreduce(&elapsed_time, &max_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
-        
+    // With -o tree all keys are merged on the root in a binary tree, and
+    // the root writes the output alone. By default every rank writes its
+    // own keys, which are already in rank order.
+    const int tree = strcmp(output_format, "tree") == 0;
+    if (tree && p > 1) {
         // Tree-based merge
         int step = 1;
         while (step < p) {
@@ -223,7 +732,17 @@ int main(int argc, char** argv) {
 
     if (id == 0) {
         printf("%f\n", max_time);
+        if (balance) {
+            fprintf(stderr, "imbalance (largest over average chunk): %.3f before rebalancing, %.3f after\n", imbalance[0], imbalance[1]);
+        }
+    }
 
+    int write_status = 0;
+    if (strcmp(output_format, "binary") == 0) {
+        write_status = write_binary_output(argv[2], chunk, chunk_size, MPI_COMM_WORLD);
+    } else if (!tree) {
+        write_status = write_text_output(argv[2], chunk, chunk_size, MPI_COMM_WORLD);
+    } else if (id == 0) {
         FILE *fo = fopen(argv[2], "w");
         if (!fo) {
             fprintf(stderr, "Failed to open file %s\n", argv[2]);
@@ -243,5 +762,5 @@ int main(int argc, char** argv) {
 
     MPI_Finalize();
 
-    return 0;
+    return (write_status == 0) ? 0 : 1;
 }